@@ -0,0 +1,390 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include "pool.h"
+
+/* The pool is kept as one free bitmap per chunk size: bit i of a
+ * level is set when the i-th chunk of that size is free. Every uid is
+ * covered by at most one free chunk, since buddies that are both free
+ * are always merged into their parent.
+ *
+ * On top of each level sits a summary bitmap with one bit per
+ * non-zero bitmap word, and the levels word has one bit per level
+ * that has at least one free chunk. Finding a free chunk is therefore
+ * a couple of ctz() scans, and nothing here ever touches the heap: the
+ * whole state of a 2^31 uid pool is about 9K. */
+
+#define BUDDY_LEVELS (CHUNK_MAX_EXP - CHUNK_MIN_EXP + 1)
+#define LEVEL_CHUNKS(size) (POOL_SIZE >> ((size) - 1))
+#define LEVEL_WORDS(size) ((LEVEL_CHUNKS(size) + 63) / 64)
+#define BUDDY_WORDS (LEVEL_WORDS(CHUNK_MIN_EXP) * 2 + BUDDY_LEVELS)
+#define SUMMARY_WORDS ((LEVEL_WORDS(CHUNK_MIN_EXP) + 63) / 64)
+
+assert_cc(BUDDY_LEVELS <= 64);
+
+static struct {
+        uint64_t levels;
+        uint64_t summary[BUDDY_LEVELS][SUMMARY_WORDS];
+        uint64_t bits[BUDDY_WORDS];
+} buddy;
+
+static unsigned level_offset[BUDDY_LEVELS];
+
+static bool chunk_is_free(unsigned l, uint64_t idx) {
+        return buddy.bits[level_offset[l] + idx / 64] & (1ULL << (idx % 64));
+}
+
+static void chunk_mark_free(unsigned l, uint64_t idx) {
+        uint64_t w = idx / 64;
+
+        buddy.bits[level_offset[l] + w] |= 1ULL << (idx % 64);
+        buddy.summary[l][w / 64] |= 1ULL << (w % 64);
+        buddy.levels |= 1ULL << l;
+}
+
+static void chunk_mark_used(unsigned l, uint64_t idx) {
+        uint64_t w = idx / 64;
+        unsigned i;
+
+        buddy.bits[level_offset[l] + w] &= ~(1ULL << (idx % 64));
+        if (buddy.bits[level_offset[l] + w])
+                return;
+
+        buddy.summary[l][w / 64] &= ~(1ULL << (w % 64));
+        for (i = 0; i < SUMMARY_WORDS; i++)
+                if (buddy.summary[l][i])
+                        return;
+
+        buddy.levels &= ~(1ULL << l);
+}
+
+static uint64_t level_first_free(unsigned l) {
+        unsigned i;
+
+        for (i = 0; i < SUMMARY_WORDS; i++)
+                if (buddy.summary[l][i]) {
+                        uint64_t w = i * 64 + __builtin_ctzll(buddy.summary[l][i]);
+
+                        return w * 64 + __builtin_ctzll(buddy.bits[level_offset[l] + w]);
+                }
+
+        /* The levels word claims there is a free chunk */
+        assert(false);
+        return 0;
+}
+
+static void buddy_layout(void) {
+        unsigned l, offset = 0;
+
+        for (l = 0; l < BUDDY_LEVELS; l++) {
+                level_offset[l] = offset;
+                offset += LEVEL_WORDS(l + CHUNK_MIN_EXP);
+        }
+        assert(offset <= BUDDY_WORDS);
+}
+
+static void buddy_init(void) {
+        uint64_t i;
+
+        zero(buddy);
+        buddy_layout();
+
+        for (i = 0; i < INIT_CHUNK_COUNT; i++)
+                chunk_mark_free(BUDDY_LEVELS - 1, i);
+}
+
+/* Returns the smallest level with a free chunk of at least len uids,
+ * and the size of the chunk that len needs */
+static int buddy_fit(uint64_t len, uint32_t *ret_size) {
+        uint64_t mask;
+        uint32_t size;
+
+        size = bitsize(len);
+        if (size > CHUNK_MAX_EXP)
+                return -E2BIG;
+        if (size < CHUNK_MIN_EXP)
+                size = CHUNK_MIN_EXP;
+
+        mask = buddy.levels & ~((1ULL << (size - CHUNK_MIN_EXP)) - 1);
+        if (mask == 0)
+                return -ENOSPC;
+
+        *ret_size = size;
+        return __builtin_ctzll(mask);
+}
+
+static int buddy_can_alloc(uint64_t len) {
+        uint32_t size;
+        int r;
+
+        assert(len > 0);
+
+        r = buddy_fit(len, &size);
+        return r < 0 ? r : 0;
+}
+
+static int buddy_alloc(uint64_t len, Chunk *ret) {
+        uint64_t idx;
+        unsigned l, want;
+        uint32_t size;
+        int r;
+
+        assert(ret);
+        assert(len > 0);
+
+        r = buddy_fit(len, &size);
+        if (r < 0)
+                return r;
+
+        l = r;
+        want = size - CHUNK_MIN_EXP;
+        idx = level_first_free(l);
+        chunk_mark_used(l, idx);
+
+        /* Split down to the requested size, the upper half of every
+         * split stays behind as a free chunk one level down */
+        while (l > want) {
+                l--;
+                idx *= 2;
+                chunk_mark_free(l, idx + 1);
+        }
+
+        ret->start = POOL_START + (idx << (size - 1));
+        ret->len = CHUNK_LEN(size);
+        ret->size = size;
+        ret->extent = NULL;
+
+        return 0;
+}
+
+static uint64_t buddy_chunk_len(uint64_t len) {
+        /* Too large to be allocated anyway */
+        if (len > CHUNK_MAX)
+                return len;
+
+        return CHUNK_LEN(MAX(bitsize(len), (uint32_t) CHUNK_MIN_EXP));
+}
+
+static int chunk_check(uint64_t start, uint64_t len) {
+        uint32_t size;
+
+        assert(len > 0);
+
+        size = bitsize(len);
+        if (size > CHUNK_MAX_EXP)
+                return -E2BIG;
+        if (size < CHUNK_MIN_EXP || CHUNK_LEN(size) != len)
+                return -EINVAL;
+        if (start < POOL_START || start > POOL_END || (start - POOL_START) % len != 0)
+                return -EINVAL;
+
+        return 0;
+}
+
+static int buddy_claim(uint64_t start, uint64_t len, Chunk *ret) {
+        unsigned l, want;
+        uint32_t size;
+        uint64_t idx;
+        int r;
+
+        assert(ret);
+
+        /* Rounded up just like buddy_alloc() does, the start has to be
+         * aligned to what we actually hand out */
+        len = buddy_chunk_len(len);
+
+        r = chunk_check(start, len);
+        if (r < 0)
+                return r;
+
+        size = bitsize(len);
+
+        want = size - CHUNK_MIN_EXP;
+        idx = (start - POOL_START) >> (size - 1);
+
+        /* Walk up until we hit the free chunk covering the range, then
+         * split our way back down to it */
+        for (l = want; l < BUDDY_LEVELS; l++)
+                if (chunk_is_free(l, idx >> (l - want)))
+                        break;
+        if (l >= BUDDY_LEVELS)
+                return -EBUSY;
+
+        chunk_mark_used(l, idx >> (l - want));
+        while (l > want) {
+                l--;
+                chunk_mark_free(l, (idx >> (l - want)) ^ 1);
+        }
+
+        ret->start = start;
+        ret->len = len;
+        ret->size = size;
+        ret->extent = NULL;
+
+        return 0;
+}
+
+static void buddy_free(Chunk *c) {
+        unsigned l;
+        uint64_t idx;
+
+        assert(c);
+        assert(c->size >= CHUNK_MIN_EXP && c->size <= CHUNK_MAX_EXP);
+        assert(c->start >= POOL_START && c->start + CHUNK_LEN(c->size) - 1 <= POOL_END);
+
+        l = c->size - CHUNK_MIN_EXP;
+        idx = (c->start - POOL_START) >> (c->size - 1);
+
+        /* Merge with the buddy for as long as it is free, the initial
+         * chunks have no buddy */
+        while (l < BUDDY_LEVELS - 1 && chunk_is_free(l, idx ^ 1)) {
+                chunk_mark_used(l, idx ^ 1);
+                idx /= 2;
+                l++;
+        }
+
+        chunk_mark_free(l, idx);
+}
+
+static int buddy_resize(Chunk *c, uint64_t len) {
+        unsigned l, want, i;
+        uint32_t size;
+        uint64_t idx, j;
+
+        assert(c);
+        assert(len > 0);
+
+        if (len > CHUNK_MAX)
+                return -E2BIG;
+
+        size = MAX(bitsize(len), (uint32_t) CHUNK_MIN_EXP);
+        l = c->size - CHUNK_MIN_EXP;
+        want = size - CHUNK_MIN_EXP;
+        idx = (c->start - POOL_START) >> (c->size - 1);
+
+        if (want < l) {
+                /* Keep the lower half, the upper half of every split
+                 * goes back; its buddy is us, so nothing merges */
+                while (l > want) {
+                        l--;
+                        idx *= 2;
+                        chunk_mark_free(l, idx + 1);
+                }
+        } else if (want > l) {
+                /* The start only stays put if we are the lower buddy
+                 * on every level up and all upper ones are free */
+                for (i = l, j = idx; i < want; i++, j /= 2)
+                        if ((j & 1) || !chunk_is_free(i, j ^ 1))
+                                return -EBUSY;
+
+                for (i = l, j = idx; i < want; i++, j /= 2)
+                        chunk_mark_used(i, j ^ 1);
+        }
+
+        c->size = size;
+        c->len = CHUNK_LEN(size);
+
+        return 0;
+}
+
+static uint64_t buddy_free_uids(void) {
+        uint64_t n = 0;
+        unsigned l, w;
+
+        for (l = 0; l < BUDDY_LEVELS; l++)
+                for (w = 0; w < LEVEL_WORDS(l + CHUNK_MIN_EXP); w++)
+                        n += (uint64_t) __builtin_popcountll(buddy.bits[level_offset[l] + w]) << (l + CHUNK_MIN_EXP - 1);
+
+        return n;
+}
+
+/* Covers [start, end) with the largest aligned free chunks that fit,
+ * which never leaves two free buddies unmerged */
+static void buddy_free_range(uint64_t start, uint64_t end) {
+        while (start < end) {
+                uint64_t off = start - POOL_START;
+                uint32_t size = CHUNK_MAX_EXP;
+
+                if (off > 0)
+                        size = MIN(size, (uint32_t) __builtin_ctzll(off) + 1);
+                while (CHUNK_LEN(size) > end - start)
+                        size--;
+
+                chunk_mark_free(size - CHUNK_MIN_EXP, off >> (size - 1));
+                start += CHUNK_LEN(size);
+        }
+}
+
+static int buddy_build(Chunk *chunks, size_t n) {
+        uint64_t pos = POOL_START;
+        size_t i;
+        int r;
+
+        zero(buddy);
+        buddy_layout();
+
+        for (i = 0; i < n; i++) {
+                r = chunk_check(chunks[i].start, chunks[i].len);
+                if (r < 0)
+                        return r;
+                if (chunks[i].start < pos)
+                        return -EBUSY;
+
+                buddy_free_range(pos, chunks[i].start);
+
+                chunks[i].size = bitsize(chunks[i].len);
+                chunks[i].extent = NULL;
+                pos = chunks[i].start + chunks[i].len;
+        }
+
+        buddy_free_range(pos, (uint64_t) POOL_END + 1);
+
+        return 0;
+}
+
+static const void *buddy_state(size_t *ret_size) {
+        *ret_size = sizeof(buddy);
+        return &buddy;
+}
+
+static int buddy_restore(const void *state, size_t size) {
+        if (size != sizeof(buddy))
+                return -EINVAL;
+
+        memcpy(&buddy, state, size);
+        buddy_layout();
+
+        return 0;
+}
+
+static int buddy_restore_chunk(uint64_t start, uint64_t len, Chunk *ret) {
+        int r;
+
+        r = chunk_check(start, len);
+        if (r < 0)
+                return r;
+
+        ret->start = start;
+        ret->len = len;
+        ret->size = bitsize(len);
+        ret->extent = NULL;
+
+        return 0;
+}
+
+const struct pool_ops buddy_pool_ops = {
+        .name = "buddy",
+        .init = buddy_init,
+        .alloc = buddy_alloc,
+        .can_alloc = buddy_can_alloc,
+        .chunk_len = buddy_chunk_len,
+        .claim = buddy_claim,
+        .build = buddy_build,
+        .free = buddy_free,
+        .resize = buddy_resize,
+        .free_uids = buddy_free_uids,
+        .state = buddy_state,
+        .restore = buddy_restore,
+        .restore_chunk = buddy_restore_chunk,
+};
@@ -23,7 +23,10 @@ int safe_atollu(const char *s, uint64_t *ret_llu) {
 }
 void help() {
         printf("uidalloc alloc COUNT [ALIAS]\n"
-               "uidalloc release {ID|alias=ALIAS}\n");
+               "uidalloc alloc-at START COUNT [ALIAS]\n"
+               "uidalloc can-alloc COUNT\n"
+               "uidalloc release {ID|alias=ALIAS}\n"
+               "uidalloc resize {ID|alias=ALIAS} COUNT\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -68,6 +71,65 @@ int main(int argc, char *argv[]) {
                         return r;
                 }
                 printf("got reply, start: %lu, size: %lu (%s)\n", reply_start, reply_size,path);                
+        } else if (streq("alloc-at",argv[1])) {
+                uint64_t start;
+                uint64_t size;
+                uint64_t reply_size;
+                uint64_t reply_start;
+                const char *alias = "";
+
+                if (argc < 4) {
+                        help();
+                        return EXIT_FAILURE;
+                }
+
+                r = safe_atollu(argv[2], &start);
+                if (r >= 0)
+                        r = safe_atollu(argv[3], &size);
+                if (r < 0) {
+                        log_error("Failed to parse range: %s", strerror(-r));
+                        goto end;
+                }
+
+                if (argv[4])
+                        alias = argv[4];
+
+                r = sd_bus_call_method(
+                        bus, "be.enospc.uidallocd", "/be/enospc/uidallocd", "be.enospc.uidallocd.Manager",
+                        "AllocUidsAt", &err, &reply, "sttb", alias, start, size, false);
+                if (r < 0) {
+                        log_error("Failed to alloc uids: %s", err.message ? err.message : strerror(-r));
+                        goto end;
+                }
+                r = sd_bus_message_read(reply, "ott", &path, &reply_start, &reply_size);
+                if (r < 0) {
+                        log_error("Failed to read reply: %s", strerror(-r));
+                        return r;
+                }
+                printf("got reply, start: %lu, size: %lu (%s)\n", reply_start, reply_size,path);
+        } else if (streq("can-alloc",argv[1])) {
+                uint64_t size;
+                int can;
+
+                r = safe_atollu(argv[2], &size);
+                if (r < 0) {
+                        log_error("Failed to parse size: %s", strerror(-r));
+                        goto end;
+                }
+
+                r = sd_bus_call_method(
+                        bus, "be.enospc.uidallocd", "/be/enospc/uidallocd", "be.enospc.uidallocd.Manager",
+                        "CanAllocate", &err, &reply, "t", size);
+                if (r < 0) {
+                        log_error("Failed to query pool: %s", err.message ? err.message : strerror(-r));
+                        goto end;
+                }
+                r = sd_bus_message_read(reply, "b", &can);
+                if (r < 0) {
+                        log_error("Failed to read reply: %s", strerror(-r));
+                        return r;
+                }
+                printf("%s\n", can ? "yes" : "no");
         } else if (streq("release",argv[1])) {
                 const char *id = argv[2];
                 const char *alias;
@@ -90,6 +152,46 @@ int main(int argc, char *argv[]) {
                         goto end;
                 }
 
+        } else if (streq("resize",argv[1])) {
+                const char *id = argv[2];
+                const char *alias;
+                uint64_t size;
+                uint64_t reply_size;
+
+                if (argc < 4) {
+                        help();
+                        return EXIT_FAILURE;
+                }
+
+                r = safe_atollu(argv[3], &size);
+                if (r < 0) {
+                        log_error("Failed to parse size: %s", strerror(-r));
+                        goto end;
+                }
+
+                path = newa0(char, strlen(id)+ strlen("/be/enospc/uidallocd/leases/")+1);
+                alias = startswith(id, "alias=");
+                if (alias) {
+                        strcat(path, "/be/enospc/uidallocd/aliases/");
+                        strcat(path, alias);
+                } else {
+                        strcat(path, "/be/enospc/uidallocd/leases/");
+                        strcat(path, id);
+                }
+
+                r = sd_bus_call_method(
+                        bus, "be.enospc.uidallocd", path, "be.enospc.uidallocd.Lease",
+                        "Resize", &err, &reply, "t", size);
+                if (r < 0) {
+                        log_error("Failed to resize lease: %s", err.message ? err.message : strerror(-r));
+                        goto end;
+                }
+                r = sd_bus_message_read(reply, "t", &reply_size);
+                if (r < 0) {
+                        log_error("Failed to read reply: %s", strerror(-r));
+                        return r;
+                }
+                printf("got reply, size: %lu\n", reply_size);
         }
 
 end:
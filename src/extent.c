@@ -0,0 +1,442 @@
+#include <assert.h>
+#include <errno.h>
+
+#include "list.h"
+#include "pool.h"
+
+/* Exact-size allocation with a two-level segregated free index, as in
+ * TLSF: free extents are kept on one list per size class, the first
+ * level picks the power of two below the length and the second level
+ * splits that range into SL_COUNT linear classes. Two bitmaps record
+ * which lists are non-empty, so finding a fitting extent takes two
+ * ctz() calls.
+ *
+ * Every extent, free or allocated, is also linked in address order,
+ * which lets a released extent find and swallow its free neighbours in
+ * constant time. Extent nodes that fall out of a merge are kept around
+ * for the next split instead of being freed. */
+
+#define SL_LOG 4
+#define SL_COUNT (1U << SL_LOG)
+#define FL_COUNT 64
+
+struct Extent {
+        uint64_t start;
+        uint64_t len;
+        bool free;
+        LIST_FIELDS(Extent, phys);
+        LIST_FIELDS(Extent, freelist);
+};
+
+static struct {
+        uint64_t fl_map;
+        uint32_t sl_map[FL_COUNT];
+        LIST_HEAD(Extent) free[FL_COUNT][SL_COUNT];
+        LIST_HEAD(Extent) phys;
+        LIST_HEAD(Extent) spare;
+        uint64_t free_uids;
+} extents;
+
+static void mapping_insert(uint64_t len, unsigned *fl, unsigned *sl) {
+        *fl = 63 - __builtin_clzll(len);
+        *sl = *fl < SL_LOG ? 0 : (len >> (*fl - SL_LOG)) & (SL_COUNT - 1);
+}
+
+/* Like mapping_insert(), but rounds up to the next class unless len is
+ * the lower bound of its own, so every extent found is long enough */
+static void mapping_search(uint64_t len, unsigned *fl, unsigned *sl) {
+        unsigned f;
+
+        f = 63 - __builtin_clzll(len);
+        if (f < SL_LOG) {
+                *fl = (len & (len - 1)) ? f + 1 : f;
+                *sl = 0;
+                return;
+        }
+
+        mapping_insert(len + (1ULL << (f - SL_LOG)) - 1, fl, sl);
+}
+
+static void extent_link_free(Extent *e) {
+        unsigned fl, sl;
+
+        mapping_insert(e->len, &fl, &sl);
+        LIST_PREPEND(freelist, extents.free[fl][sl], e);
+        extents.sl_map[fl] |= 1U << sl;
+        extents.fl_map |= 1ULL << fl;
+
+        e->free = true;
+        extents.free_uids += e->len;
+}
+
+static void extent_unlink_free(Extent *e) {
+        unsigned fl, sl;
+
+        assert(e->free);
+
+        mapping_insert(e->len, &fl, &sl);
+        LIST_REMOVE(freelist, extents.free[fl][sl], e);
+        if (LIST_EMPTY(extents.free[fl][sl])) {
+                extents.sl_map[fl] &= ~(1U << sl);
+                if (extents.sl_map[fl] == 0)
+                        extents.fl_map &= ~(1ULL << fl);
+        }
+
+        e->free = false;
+        extents.free_uids -= e->len;
+}
+
+static Extent *extent_find_free(uint64_t len) {
+        unsigned fl, sl;
+        uint32_t sl_map;
+
+        mapping_search(len, &fl, &sl);
+        if (fl >= FL_COUNT)
+                return NULL;
+
+        sl_map = extents.sl_map[fl] & (~0U << sl);
+        if (sl_map == 0) {
+                uint64_t fl_map;
+
+                fl_map = fl + 1 < FL_COUNT ? extents.fl_map & (~0ULL << (fl + 1)) : 0;
+                if (fl_map == 0)
+                        return NULL;
+
+                fl = __builtin_ctzll(fl_map);
+                sl_map = extents.sl_map[fl];
+        }
+
+        sl = __builtin_ctz(sl_map);
+        return extents.free[fl][sl];
+}
+
+static Extent *extent_new(void) {
+        Extent *e;
+
+        e = LIST_STEAL_FIRST(freelist, extents.spare);
+        if (e)
+                return e;
+
+        return new0(Extent, 1);
+}
+
+static void extent_recycle(Extent *e) {
+        LIST_REMOVE(phys, extents.phys, e);
+        LIST_PREPEND(freelist, extents.spare, e);
+}
+
+static void extent_clear(void) {
+        Extent *e;
+
+        while ((e = LIST_STEAL_FIRST(phys, extents.phys)))
+                free(e);
+        while ((e = LIST_STEAL_FIRST(freelist, extents.spare)))
+                free(e);
+
+        zero(extents);
+}
+
+/* Appends an extent behind tail in address order */
+static Extent *extent_append(Extent *tail, uint64_t start, uint64_t len) {
+        Extent *e;
+
+        e = new0(Extent, 1);
+        if (!e)
+                return NULL;
+
+        e->start = start;
+        e->len = len;
+        if (tail)
+                LIST_INSERT_AFTER(phys, extents.phys, tail, e);
+        else
+                LIST_PREPEND(phys, extents.phys, e);
+
+        return e;
+}
+
+static void extent_init(void) {
+        Extent *e;
+
+        extent_clear();
+
+        e = extent_append(NULL, POOL_START, POOL_SIZE);
+        assert(e);
+        extent_link_free(e);
+}
+
+static int extent_build(Chunk *chunks, size_t n) {
+        uint64_t pos = POOL_START;
+        Extent *tail = NULL;
+        size_t i;
+
+        extent_clear();
+
+        for (i = 0; i < n; i++) {
+                uint64_t start = chunks[i].start, len = chunks[i].len;
+
+                if (len == 0 || len > CHUNK_MAX)
+                        return -E2BIG;
+                if (start < POOL_START || start > POOL_END || len > POOL_END - start + 1)
+                        return -EINVAL;
+                if (start < pos)
+                        return -EBUSY;
+
+                if (start > pos) {
+                        tail = extent_append(tail, pos, start - pos);
+                        if (!tail)
+                                return -ENOMEM;
+                        extent_link_free(tail);
+                }
+
+                tail = extent_append(tail, start, len);
+                if (!tail)
+                        return -ENOMEM;
+
+                chunks[i].size = bitsize(len);
+                chunks[i].extent = tail;
+                pos = start + len;
+        }
+
+        if (pos <= POOL_END) {
+                tail = extent_append(tail, pos, (uint64_t) POOL_END - pos + 1);
+                if (!tail)
+                        return -ENOMEM;
+                extent_link_free(tail);
+        }
+
+        return 0;
+}
+
+static int extent_can_alloc(uint64_t len) {
+        assert(len > 0);
+
+        if (len > CHUNK_MAX)
+                return -E2BIG;
+
+        return extent_find_free(len) ? 0 : -ENOSPC;
+}
+
+static int extent_alloc(uint64_t len, Chunk *ret) {
+        Extent *e;
+
+        assert(ret);
+        assert(len > 0);
+
+        if (len > CHUNK_MAX)
+                return -E2BIG;
+
+        e = extent_find_free(len);
+        if (!e)
+                return -ENOSPC;
+
+        if (e->len > len) {
+                Extent *rest;
+
+                rest = extent_new();
+                if (!rest)
+                        return -ENOMEM;
+
+                extent_unlink_free(e);
+
+                rest->start = e->start + len;
+                rest->len = e->len - len;
+                LIST_INSERT_AFTER(phys, extents.phys, e, rest);
+                extent_link_free(rest);
+
+                e->len = len;
+        } else
+                extent_unlink_free(e);
+
+        ret->start = e->start;
+        ret->len = e->len;
+        ret->size = bitsize(e->len);
+        ret->extent = e;
+
+        return 0;
+}
+
+static uint64_t extent_chunk_len(uint64_t len) {
+        return len;
+}
+
+static int extent_claim(uint64_t start, uint64_t len, Chunk *ret) {
+        Extent *e, *head = NULL, *tail = NULL;
+
+        assert(ret);
+        assert(len > 0);
+
+        if (len > CHUNK_MAX)
+                return -E2BIG;
+        if (start < POOL_START || start > POOL_END || len > POOL_END - start + 1)
+                return -EINVAL;
+
+        /* Search from the top, which makes restoring leases in
+         * ascending order cheap. Anywhere else this is linear in the
+         * number of extents, there is no index by address. */
+        LIST_FOREACH_REVERSE(phys, e, extents.phys)
+                if (e->start <= start)
+                        break;
+
+        assert(e);
+        if (!e->free || start + len > e->start + e->len)
+                return -EBUSY;
+
+        /* Get both nodes we might need up front, so that running out
+         * of memory leaves the free lists untouched */
+        if (e->start < start) {
+                head = extent_new();
+                if (!head)
+                        return -ENOMEM;
+        }
+        if (start + len < e->start + e->len) {
+                tail = extent_new();
+                if (!tail) {
+                        if (head)
+                                LIST_PREPEND(freelist, extents.spare, head);
+                        return -ENOMEM;
+                }
+        }
+
+        extent_unlink_free(e);
+
+        if (head) {
+                head->start = e->start;
+                head->len = start - e->start;
+                LIST_INSERT_BEFORE(phys, extents.phys, e, head);
+                extent_link_free(head);
+
+                e->start = start;
+                e->len -= head->len;
+        }
+
+        if (tail) {
+                tail->start = start + len;
+                tail->len = e->len - len;
+                LIST_INSERT_AFTER(phys, extents.phys, e, tail);
+                extent_link_free(tail);
+
+                e->len = len;
+        }
+
+        ret->start = e->start;
+        ret->len = e->len;
+        ret->size = bitsize(e->len);
+        ret->extent = e;
+
+        return 0;
+}
+
+static void extent_free(Chunk *c) {
+        Extent *e, *n;
+
+        assert(c);
+        assert(c->extent);
+
+        e = c->extent;
+        assert(!e->free);
+
+        if (e->phys_prev && e->phys_prev->free) {
+                Extent *p = e->phys_prev;
+
+                extent_unlink_free(p);
+                p->len += e->len;
+                extent_recycle(e);
+                e = p;
+        }
+
+        n = e->phys_next;
+        if (n && n->free) {
+                extent_unlink_free(n);
+                e->len += n->len;
+                extent_recycle(n);
+        }
+
+        extent_link_free(e);
+        c->extent = NULL;
+}
+
+static int extent_resize(Chunk *c, uint64_t len) {
+        Extent *e, *n;
+
+        assert(c);
+        assert(c->extent);
+        assert(len > 0);
+
+        if (len > CHUNK_MAX)
+                return -E2BIG;
+
+        e = c->extent;
+        n = e->phys_next;
+
+        if (len < e->len) {
+                /* The cut off tail joins a free neighbour or becomes
+                 * one */
+                if (n && n->free) {
+                        extent_unlink_free(n);
+                        n->start -= e->len - len;
+                        n->len += e->len - len;
+                } else {
+                        n = extent_new();
+                        if (!n)
+                                return -ENOMEM;
+
+                        n->start = e->start + len;
+                        n->len = e->len - len;
+                        LIST_INSERT_AFTER(phys, extents.phys, e, n);
+                }
+                extent_link_free(n);
+
+        } else if (len > e->len) {
+                uint64_t grow = len - e->len;
+
+                if (!n || !n->free || n->len < grow)
+                        return -EBUSY;
+
+                extent_unlink_free(n);
+                if (n->len == grow)
+                        extent_recycle(n);
+                else {
+                        n->start += grow;
+                        n->len -= grow;
+                        extent_link_free(n);
+                }
+        }
+
+        e->len = len;
+        c->len = len;
+        c->size = bitsize(len);
+
+        return 0;
+}
+
+static uint64_t extent_free_uids(void) {
+        return extents.free_uids;
+}
+
+/* Extents are pointer-linked, there is no flat state worth saving:
+ * a restored pool is simply rebuilt from the leases */
+static const void *extent_state(size_t *ret_size) {
+        *ret_size = 0;
+        return NULL;
+}
+
+static int extent_restore(const void *state, size_t size) {
+        extent_init();
+        return 0;
+}
+
+const struct pool_ops extent_pool_ops = {
+        .name = "extent",
+        .init = extent_init,
+        .alloc = extent_alloc,
+        .can_alloc = extent_can_alloc,
+        .chunk_len = extent_chunk_len,
+        .claim = extent_claim,
+        .build = extent_build,
+        .free = extent_free,
+        .resize = extent_resize,
+        .free_uids = extent_free_uids,
+        .state = extent_state,
+        .restore = extent_restore,
+        .restore_chunk = extent_claim,
+};
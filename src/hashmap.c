@@ -23,35 +23,110 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "util.h"
 #include "hashmap.h"
 #include "siphash24.h"
 
-#define INITIAL_N_BUCKETS 31
+/* Open addressing in the style of the Swiss tables: every slot has a
+ * control byte that is either empty, deleted or carries the low seven
+ * bits of the hash of the entry in that slot. The remaining hash bits
+ * pick the group of slots a lookup starts at, and the whole group is
+ * matched against the control byte at once, so a lookup usually
+ * compares a single key.
+ *
+ * Slots only store an index into the entries array, which keeps keys
+ * and values inline and in insertion order. Removing an entry leaves a
+ * hole in that array until the next rebuild squeezes it out.
+ *
+ * Entries remember their full hash, so rebuilding the table on growth
+ * hashes nothing. The keyed hash still protects against flooding: if
+ * an insertion has to probe too far the table is rekeyed and every
+ * entry hashed again.
+ *
+ * Growing or shrinking does not happen in one go. A new index is set
+ * up next to the old one and every modifying operation migrates a few
+ * more entries to it, compacting the entries array on the way, until
+ * the old index can be dropped. Lookups consult both meanwhile. */
+
+#if defined(__AVX2__)
+#define GROUP_SIZE 32
+#else
+#define GROUP_SIZE 16
+#endif
+
+#define CTRL_EMPTY ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xfe)
+
+#define H1(hash) ((unsigned) ((hash) >> 7))
+#define H2(hash) ((uint8_t) ((hash) & 0x7f))
+
+/* Keep at least one eighth of the slots empty so probing terminates */
+#define CAPACITY(n_buckets) ((n_buckets) - (n_buckets) / 8)
+
+/* Groups an insertion may probe before we suspect the hash key. The
+ * longest honest probe grows with the log of the table size, so that
+ * is added on top. */
+#define MAX_PROBE 16
+
+/* Entries migrated per modifying operation */
+#define MIGRATE_STEP 32
+
+#define IDX_NIL UINT_MAX
 
 struct hashmap_entry {
         const void *key;
         void *value;
-        struct hashmap_entry *bucket_next, *bucket_previous;
-        struct hashmap_entry *iterate_next, *iterate_previous;
+        unsigned long hash;
+};
+
+struct hashmap_index {
+        uint8_t *ctrl;
+        unsigned *slots;
+        unsigned n_buckets;
+        unsigned growth_left;
 };
 
 struct Hashmap {
         const struct hash_ops *hash_ops;
 
-        struct hashmap_entry *iterate_list_head, *iterate_list_tail;
+        struct hashmap_index index;
 
-        struct hashmap_entry ** buckets;
-        unsigned n_buckets, n_entries;
+        /* While migrating, entries[migrate_src, migrate_end) are
+         * still only found through old, and entries[migrate_dst,
+         * migrate_src) are holes left behind by the compaction */
+        struct hashmap_index old;
+        unsigned migrate_src, migrate_dst, migrate_end;
+
+        struct hashmap_entry *entries;
+        unsigned n_entries, n_used, n_allocated;
+        unsigned first;
 
         uint8_t hash_key[HASH_KEY_SIZE];
+        bool rekey;
 };
 
-struct hashmap_tile {
-        Hashmap h;
-        struct hashmap_entry *initial_buckets[INITIAL_N_BUCKETS];
-};
+/* Marks a hole in the entries array */
+static const char removed_key;
+#define REMOVED ((const void*) &removed_key)
+
+static void siphash24_hashes(unsigned long hashes[], const void *const in[], const size_t inlen[], unsigned n, const uint8_t hash_key[HASH_KEY_SIZE]) {
+        uint64_t u[HASH_MANY_MAX];
+        unsigned i;
+
+        assert(n <= HASH_MANY_MAX);
+
+        siphash24_many((uint8_t(*)[8]) u, in, inlen, n, hash_key);
+        for (i = 0; i < n; i++)
+                hashes[i] = (unsigned long) u[i];
+}
 
 unsigned long string_hash_func(const void *p, const uint8_t hash_key[HASH_KEY_SIZE]) {
         uint64_t u;
@@ -59,36 +134,85 @@ unsigned long string_hash_func(const void *p, const uint8_t hash_key[HASH_KEY_SI
         return (unsigned long) u;
 }
 
+static void string_hash_many_func(unsigned long hashes[], const void *const keys[], unsigned n, const uint8_t hash_key[HASH_KEY_SIZE]) {
+        size_t l[HASH_MANY_MAX] = {};
+        unsigned i;
+
+        for (i = 0; i < n; i++)
+                l[i] = strlen(keys[i]);
+
+        siphash24_hashes(hashes, keys, l, n, hash_key);
+}
+
 int string_compare_func(const void *a, const void *b) {
         return strcmp(a, b);
 }
 
 const struct hash_ops string_hash_ops = {
         .hash = string_hash_func,
+        .hash_many = string_hash_many_func,
+        .compare = string_compare_func
+};
+
+unsigned long trusted_string_hash_func(const void *p, const uint8_t hash_key[HASH_KEY_SIZE]) {
+        uint64_t u;
+        siphash13((uint8_t*) &u, p, strlen(p), hash_key);
+        return (unsigned long) u;
+}
+
+const struct hash_ops trusted_string_hash_ops = {
+        .hash = trusted_string_hash_func,
         .compare = string_compare_func
 };
 
 unsigned long trivial_hash_func(const void *p, const uint8_t hash_key[HASH_KEY_SIZE]) {
         uint64_t u;
-        siphash24((uint8_t*) &u, &p, sizeof(p), hash_key);
+        if (sizeof(p) == 8)
+                siphash24_8((uint8_t*) &u, &p, hash_key);
+        else
+                siphash24((uint8_t*) &u, &p, sizeof(p), hash_key);
         return (unsigned long) u;
 }
 
+static void trivial_hash_many_func(unsigned long hashes[], const void *const keys[], unsigned n, const uint8_t hash_key[HASH_KEY_SIZE]) {
+        const void *in[HASH_MANY_MAX] = {};
+        size_t l[HASH_MANY_MAX] = {};
+        unsigned i;
+
+        for (i = 0; i < n; i++) {
+                in[i] = &keys[i];
+                l[i] = sizeof(keys[i]);
+        }
+
+        siphash24_hashes(hashes, in, l, n, hash_key);
+}
+
 int trivial_compare_func(const void *a, const void *b) {
         return a < b ? -1 : (a > b ? 1 : 0);
 }
 
 const struct hash_ops trivial_hash_ops = {
         .hash = trivial_hash_func,
+        .hash_many = trivial_hash_many_func,
         .compare = trivial_compare_func
 };
 
 unsigned long uint64_hash_func(const void *p, const uint8_t hash_key[HASH_KEY_SIZE]) {
         uint64_t u;
-        siphash24((uint8_t*) &u, p, sizeof(uint64_t), hash_key);
+        siphash24_8((uint8_t*) &u, p, hash_key);
         return (unsigned long) u;
 }
 
+static void uint64_hash_many_func(unsigned long hashes[], const void *const keys[], unsigned n, const uint8_t hash_key[HASH_KEY_SIZE]) {
+        size_t l[HASH_MANY_MAX] = {};
+        unsigned i;
+
+        for (i = 0; i < n; i++)
+                l[i] = sizeof(uint64_t);
+
+        siphash24_hashes(hashes, keys, l, n, hash_key);
+}
+
 int uint64_compare_func(const void *_a, const void *_b) {
         uint64_t a, b;
         a = *(const uint64_t*) _a;
@@ -98,11 +222,60 @@ int uint64_compare_func(const void *_a, const void *_b) {
 
 const struct hash_ops uint64_hash_ops = {
         .hash = uint64_hash_func,
+        .hash_many = uint64_hash_many_func,
         .compare = uint64_compare_func
 };
 
-static unsigned bucket_hash(Hashmap *h, const void *p) {
-        return (unsigned) (h->hash_ops->hash(p, h->hash_key) % h->n_buckets);
+
+#if defined(__AVX2__)
+static inline uint32_t group_match(const uint8_t *g, uint8_t c) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) g);
+        return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char) c)));
+}
+
+static inline uint32_t group_match_free(const uint8_t *g) {
+        /* Empty and deleted are the only control bytes with the high bit set */
+        return (uint32_t) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) g));
+}
+#elif defined(__SSE2__)
+static inline uint32_t group_match(const uint8_t *g, uint8_t c) {
+        __m128i v = _mm_loadu_si128((const __m128i*) g);
+        return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char) c)));
+}
+
+static inline uint32_t group_match_free(const uint8_t *g) {
+        return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) g));
+}
+#else
+static inline uint32_t group_match(const uint8_t *g, uint8_t c) {
+        uint32_t m = 0;
+        unsigned i;
+
+        for (i = 0; i < GROUP_SIZE; i++)
+                if (g[i] == c)
+                        m |= 1U << i;
+
+        return m;
+}
+
+static inline uint32_t group_match_free(const uint8_t *g) {
+        uint32_t m = 0;
+        unsigned i;
+
+        for (i = 0; i < GROUP_SIZE; i++)
+                if (g[i] & 0x80)
+                        m |= 1U << i;
+
+        return m;
+}
+#endif
+
+static _always_inline_ unsigned long key_hash(Hashmap *h, const void *p, hash_func_t hash_func) {
+        return (hash_func ?: h->hash_ops->hash)(p, h->hash_key);
+}
+
+static unsigned long bucket_hash(Hashmap *h, const void *p) {
+        return key_hash(h, p, NULL);
 }
 
 static void get_hash_key(uint8_t hash_key[HASH_KEY_SIZE], bool reuse_is_ok) {
@@ -125,23 +298,17 @@ static void get_hash_key(uint8_t hash_key[HASH_KEY_SIZE], bool reuse_is_ok) {
 }
 
 Hashmap *hashmap_new(const struct hash_ops *hash_ops) {
-        struct hashmap_tile *ht;
         Hashmap *h;
 
-        ht = malloc0(sizeof(struct hashmap_tile));
+        /* The index and entry arrays are allocated with the first
+         * entry */
 
-        if (!ht)
+        h = new0(Hashmap, 1);
+        if (!h)
                 return NULL;
 
-        h = &ht->h;
         h->hash_ops = hash_ops ? hash_ops : &trivial_hash_ops;
 
-        h->n_buckets = INITIAL_N_BUCKETS;
-        h->n_entries = 0;
-        h->iterate_list_head = h->iterate_list_tail = NULL;
-
-        h->buckets = ht->initial_buckets;
-
         get_hash_key(h->hash_key, true);
 
         return h;
@@ -163,71 +330,203 @@ int hashmap_ensure_allocated(Hashmap **h, const struct hash_ops *hash_ops) {
         return 0;
 }
 
-static void link_entry(Hashmap *h, struct hashmap_entry *e, unsigned hash) {
+static int index_alloc(struct hashmap_index *x, unsigned n_buckets) {
+        assert(x);
+
+        x->slots = malloc((size_t) n_buckets * (sizeof(unsigned) + 1));
+        if (!x->slots)
+                return -ENOMEM;
+
+        x->ctrl = (uint8_t*) (x->slots + n_buckets);
+        x->n_buckets = n_buckets;
+        x->growth_left = CAPACITY(n_buckets);
+        memset(x->ctrl, CTRL_EMPTY, n_buckets);
+
+        return 0;
+}
+
+static void index_free(struct hashmap_index *x) {
+        free(x->slots);
+        zero(*x);
+}
+
+static _always_inline_ unsigned index_scan(Hashmap *h, struct hashmap_index *x, unsigned long hash, const void *key, unsigned lo, compare_func_t compare_func) {
+        unsigned mask, pos, probe = 0;
+
+        /* Slots pointing below lo are stale and skipped */
+
+        if (x->n_buckets == 0)
+                return IDX_NIL;
+
+        mask = x->n_buckets / GROUP_SIZE - 1;
+        pos = H1(hash) & mask;
+
+        for (;;) {
+                const uint8_t *g = x->ctrl + pos * GROUP_SIZE;
+                uint32_t m;
+
+                for (m = group_match(g, H2(hash)); m; m &= m - 1) {
+                        unsigned s = pos * GROUP_SIZE + __builtin_ctz(m);
+
+                        if (x->slots[s] >= lo &&
+                            (compare_func ?: h->hash_ops->compare)(h->entries[x->slots[s]].key, key) == 0)
+                                return s;
+                }
+
+                /* Nothing was ever pushed past a group that still
+                 * has an empty slot */
+                if (group_match(g, CTRL_EMPTY))
+                        return IDX_NIL;
+
+                pos = (pos + ++probe) & mask;
+        }
+}
+
+static _always_inline_ unsigned hash_scan(Hashmap *h, unsigned long hash, const void *key, struct hashmap_index **x, compare_func_t compare_func) {
+        unsigned s;
+
         assert(h);
-        assert(e);
-
-        /* Insert into hash table */
-        e->bucket_next = h->buckets[hash];
-        e->bucket_previous = NULL;
-        if (h->buckets[hash])
-                h->buckets[hash]->bucket_previous = e;
-        h->buckets[hash] = e;
-
-        /* Insert into iteration list */
-        e->iterate_previous = h->iterate_list_tail;
-        e->iterate_next = NULL;
-        if (h->iterate_list_tail) {
-                assert(h->iterate_list_head);
-                h->iterate_list_tail->iterate_next = e;
-        } else {
-                assert(!h->iterate_list_head);
-                h->iterate_list_head = e;
+        assert(x);
+
+        *x = &h->index;
+        s = index_scan(h, &h->index, hash, key, 0, compare_func);
+        if (_likely_(s != IDX_NIL || !h->old.ctrl))
+                return s;
+
+        *x = &h->old;
+        return index_scan(h, &h->old, hash, key, h->migrate_src, compare_func);
+}
+
+static struct hashmap_index *entry_index(Hashmap *h, unsigned idx) {
+        if (h->old.ctrl && idx >= h->migrate_src && idx < h->migrate_end)
+                return &h->old;
+
+        return &h->index;
+}
+
+static unsigned entry_slot(struct hashmap_index *x, unsigned long hash, unsigned idx) {
+        unsigned mask, pos, probe = 0;
+
+        /* Like index_scan(), but looks for the slot of a known entry,
+         * which saves the key comparisons */
+
+        assert(x);
+        assert(x->n_buckets > 0);
+
+        mask = x->n_buckets / GROUP_SIZE - 1;
+        pos = H1(hash) & mask;
+
+        for (;;) {
+                const uint8_t *g = x->ctrl + pos * GROUP_SIZE;
+                uint32_t m;
+
+                for (m = group_match(g, H2(hash)); m; m &= m - 1) {
+                        unsigned s = pos * GROUP_SIZE + __builtin_ctz(m);
+
+                        if (x->slots[s] == idx)
+                                return s;
+                }
+
+                assert(!group_match(g, CTRL_EMPTY));
+
+                pos = (pos + ++probe) & mask;
         }
-        h->iterate_list_tail = e;
+}
 
-        h->n_entries++;
-        assert(h->n_entries >= 1);
+static void index_link(Hashmap *h, unsigned long hash, unsigned idx) {
+        struct hashmap_index *x = &h->index;
+        unsigned mask, pos, probe = 0, max_probe;
+
+        assert(x->n_buckets > 0);
+
+        mask = x->n_buckets / GROUP_SIZE - 1;
+        pos = H1(hash) & mask;
+        max_probe = MAX_PROBE + __builtin_ctz(mask + 1);
+
+        for (;;) {
+                uint32_t m;
+
+                m = group_match_free(x->ctrl + pos * GROUP_SIZE);
+                if (m) {
+                        unsigned s = pos * GROUP_SIZE + __builtin_ctz(m);
+
+                        if (x->ctrl[s] == CTRL_EMPTY) {
+                                assert(x->growth_left > 0);
+                                x->growth_left--;
+                        }
+
+                        x->ctrl[s] = H2(hash);
+                        x->slots[s] = idx;
+                        return;
+                }
+
+                if (_unlikely_(probe == max_probe))
+                        h->rekey = true;
+
+                pos = (pos + ++probe) & mask;
+        }
+}
+
+static void clear_slot(struct hashmap_index *x, unsigned s) {
+        const uint8_t *g = x->ctrl + s / GROUP_SIZE * GROUP_SIZE;
+
+        /* If the group still has an empty slot no probe sequence
+         * continues past it, so this one can become empty again too.
+         * Otherwise leave a tombstone for the probes that do. */
+        if (group_match(g, CTRL_EMPTY)) {
+                x->ctrl[s] = CTRL_EMPTY;
+                x->growth_left++;
+        } else
+                x->ctrl[s] = CTRL_DELETED;
 }
 
-static void unlink_entry(Hashmap *h, struct hashmap_entry *e, unsigned hash) {
+static unsigned next_entry(Hashmap *h, unsigned idx) {
+        while (idx < h->n_used && h->entries[idx].key == REMOVED)
+                idx++;
+
+        return idx;
+}
+
+static void link_entry(Hashmap *h, const void *key, void *value, unsigned long hash) {
+        unsigned idx;
+
         assert(h);
-        assert(e);
+        assert(h->n_used < h->n_allocated);
 
-        /* Remove from iteration list */
-        if (e->iterate_next)
-                e->iterate_next->iterate_previous = e->iterate_previous;
-        else
-                h->iterate_list_tail = e->iterate_previous;
+        idx = h->n_used++;
+        h->entries[idx].key = key;
+        h->entries[idx].value = value;
+        h->entries[idx].hash = hash;
 
-        if (e->iterate_previous)
-                e->iterate_previous->iterate_next = e->iterate_next;
-        else
-                h->iterate_list_head = e->iterate_next;
+        index_link(h, hash, idx);
 
-        /* Remove from hash table bucket list */
-        if (e->bucket_next)
-                e->bucket_next->bucket_previous = e->bucket_previous;
+        h->n_entries++;
+}
 
-        if (e->bucket_previous)
-                e->bucket_previous->bucket_next = e->bucket_next;
-        else
-                h->buckets[hash] = e->bucket_next;
+static void unlink_slot(Hashmap *h, struct hashmap_index *x, unsigned s) {
+        unsigned idx;
 
+        assert(h);
         assert(h->n_entries >= 1);
+
+        idx = x->slots[s];
+        h->entries[idx].key = REMOVED;
+        clear_slot(x, s);
+
         h->n_entries--;
+
+        if (idx == h->first)
+                h->first = next_entry(h, idx + 1);
 }
 
-static void remove_entry(Hashmap *h, struct hashmap_entry *e) {
-        unsigned hash;
+static void remove_entry(Hashmap *h, unsigned idx) {
+        struct hashmap_index *x;
 
         assert(h);
-        assert(e);
-
-        hash = bucket_hash(h, e->key);
-        unlink_entry(h, e, hash);
+        assert(idx < h->n_used);
 
-        free(e);
+        x = entry_index(h, idx);
+        unlink_slot(h, x, entry_slot(x, h->entries[idx].hash, idx));
 }
 
 void hashmap_free(Hashmap*h) {
@@ -238,10 +537,6 @@ void hashmap_free(Hashmap*h) {
                 return;
 
         hashmap_clear(h);
-
-        if (h->buckets != (struct hashmap_entry**) ((uint8_t*) h + ALIGN(sizeof(Hashmap))))
-                free(h->buckets);
-
         free(h);
 }
 
@@ -272,144 +567,358 @@ void hashmap_clear(Hashmap *h) {
         if (!h)
                 return;
 
-        while (h->iterate_list_head)
-                remove_entry(h, h->iterate_list_head);
+        index_free(&h->index);
+        index_free(&h->old);
+        free(h->entries);
+
+        h->entries = NULL;
+        h->n_entries = h->n_used = h->n_allocated = h->first = 0;
+        h->rekey = false;
 }
 
 void hashmap_clear_free(Hashmap *h) {
-        void *p;
+        unsigned idx;
 
         if (!h)
                 return;
 
-        while ((p = hashmap_steal_first(h)))
-                free(p);
+        for (idx = h->first; idx < h->n_used; idx++)
+                if (h->entries[idx].key != REMOVED)
+                        free(h->entries[idx].value);
+
+        hashmap_clear(h);
 }
 
 void hashmap_clear_free_free(Hashmap *h) {
+        unsigned idx;
+
         if (!h)
                 return;
 
-        while (h->iterate_list_head) {
-                void *a, *b;
+        for (idx = h->first; idx < h->n_used; idx++)
+                if (h->entries[idx].key != REMOVED) {
+                        free(h->entries[idx].value);
+                        free((void*) h->entries[idx].key);
+                }
+
+        hashmap_clear(h);
+}
+
+static unsigned buckets_for(unsigned entries) {
+        unsigned n = GROUP_SIZE;
+
+        while (CAPACITY(n) < entries)
+                n *= 2;
+
+        return n;
+}
+
+static unsigned migrate_slack(Hashmap *h) {
+        /* Upper bound for the entries added while a migration that
+         * starts now is still in flight */
+        return h->n_used / (MIGRATE_STEP - 1) + 1;
+}
+
+static void shrink_entries(Hashmap *h) {
+        struct hashmap_entry *e;
+
+        /* Give back what is left over after a shrink or the slack of
+         * a migration. Failing to do so is harmless. */
+
+        if (h->n_allocated <= CAPACITY(h->index.n_buckets))
+                return;
+
+        assert(h->n_used <= CAPACITY(h->index.n_buckets));
+
+        e = realloc(h->entries, (size_t) CAPACITY(h->index.n_buckets) * sizeof(struct hashmap_entry));
+        if (!e)
+                return;
+
+        h->entries = e;
+        h->n_allocated = CAPACITY(h->index.n_buckets);
+}
+
+static void rehash_batch(Hashmap *h, const unsigned at[], const void *const keys[], unsigned n) {
+        unsigned long hashes[HASH_MANY_MAX];
+        unsigned i;
+
+        h->hash_ops->hash_many(hashes, keys, n, h->hash_key);
+        for (i = 0; i < n; i++)
+                h->entries[at[i]].hash = hashes[i];
+}
+
+static void rehash_entries(Hashmap *h) {
+        const void *keys[HASH_MANY_MAX];
+        unsigned at[HASH_MANY_MAX];
+        unsigned idx, n = 0;
+
+        /* Recomputes the cached hashes after the key changed,
+         * HASH_MANY_MAX at a time if the hash_ops can do that */
+
+        for (idx = 0; idx < h->n_used; idx++) {
+                if (h->entries[idx].key == REMOVED)
+                        continue;
 
-                a = h->iterate_list_head->value;
-                b = (void*) h->iterate_list_head->key;
-                remove_entry(h, h->iterate_list_head);
-                free(a);
-                free(b);
+                if (!h->hash_ops->hash_many) {
+                        h->entries[idx].hash = bucket_hash(h, h->entries[idx].key);
+                        continue;
+                }
+
+                at[n] = idx;
+                keys[n++] = h->entries[idx].key;
+                if (n == HASH_MANY_MAX) {
+                        rehash_batch(h, at, keys, n);
+                        n = 0;
+                }
         }
+
+        if (n > 0)
+                rehash_batch(h, at, keys, n);
 }
 
-static struct hashmap_entry *hash_scan(Hashmap *h, unsigned hash, const void *key) {
+static int resize_buckets(Hashmap *h, unsigned n_buckets, bool rekey) {
+        struct hashmap_index x;
         struct hashmap_entry *e;
+        unsigned idx, n_used;
+        int r;
+
+        /* Rebuilds the index in one go, finishing any migration on
+         * the way. Returns > 0 if the hash key changed. */
+
         assert(h);
-        assert(hash < h->n_buckets);
+        assert(CAPACITY(n_buckets) >= h->n_entries);
 
-        for (e = h->buckets[hash]; e; e = e->bucket_next)
-                if (h->hash_ops->compare(e->key, key) == 0)
-                        return e;
+        r = index_alloc(&x, n_buckets);
+        if (r < 0)
+                return r;
 
-        return NULL;
+        if (CAPACITY(n_buckets) > h->n_allocated) {
+                e = realloc(h->entries, (size_t) CAPACITY(n_buckets) * sizeof(struct hashmap_entry));
+                if (!e) {
+                        index_free(&x);
+                        return -ENOMEM;
+                }
+
+                h->entries = e;
+                h->n_allocated = CAPACITY(n_buckets);
+        }
+
+        /* Somebody might have guessed the key, let's use a different
+         * randomized one from now on */
+        if (rekey) {
+                get_hash_key(h->hash_key, false);
+                rehash_entries(h);
+        }
+
+        index_free(&h->index);
+        index_free(&h->old);
+        h->index = x;
+
+        /* Squeeze out the holes while indexing the entries again;
+         * link_entry() never writes past the one being read */
+        n_used = h->n_used;
+        h->n_entries = h->n_used = h->first = 0;
+
+        for (idx = 0; idx < n_used; idx++) {
+                struct hashmap_entry i = h->entries[idx];
+
+                if (i.key == REMOVED)
+                        continue;
+
+                link_entry(h, i.key, i.value, i.hash);
+        }
+
+        shrink_entries(h);
+
+        /* Only insertions after this count towards the next rekey */
+        h->rekey = false;
+
+        return rekey;
 }
 
-static int resize_buckets(Hashmap *h, unsigned entries_add) {
-        struct hashmap_entry **n, *i;
-        unsigned m, new_n_entries, new_n_buckets;
-        uint8_t nkey[HASH_KEY_SIZE];
+static int migrate_start(Hashmap *h, unsigned n_buckets, unsigned entries_add) {
+        struct hashmap_index x;
+        struct hashmap_entry *e;
+        unsigned n_allocated;
+        int r;
 
         assert(h);
+        assert(!h->old.ctrl);
 
-        new_n_entries = h->n_entries + entries_add;
+        r = index_alloc(&x, n_buckets);
+        if (r < 0)
+                return r;
 
-        /* overflow? */
-        if (_unlikely_(new_n_entries < entries_add || new_n_entries > UINT_MAX / 4))
-                return -ENOMEM;
+        /* The entries array is only compacted behind the migration,
+         * so what is appended meanwhile must fit after it. A shrink
+         * does not bother and rebuilds in one go if it runs out. */
+        n_allocated = CAPACITY(n_buckets);
+        if (entries_add > 0)
+                n_allocated = MAX(n_allocated, h->n_used + entries_add + migrate_slack(h));
+        if (n_allocated > h->n_allocated) {
+                e = realloc(h->entries, (size_t) n_allocated * sizeof(struct hashmap_entry));
+                if (!e) {
+                        index_free(&x);
+                        return -ENOMEM;
+                }
+
+                h->entries = e;
+                h->n_allocated = n_allocated;
+        }
 
-        new_n_buckets = new_n_entries * 4 / 3;
+        h->old = h->index;
+        h->index = x;
 
-        if (_likely_(new_n_buckets <= h->n_buckets))
-                return 0;
+        h->migrate_src = h->migrate_dst = 0;
+        h->migrate_end = h->n_used;
 
-        /* Increase by four at least */
-        m = MAX((h->n_entries+1)*4-1, new_n_buckets);
+        return 0;
+}
 
-        /* If we hit OOM we simply risk packed hashmaps... */
-        n = new0(struct hashmap_entry*, m);
-        if (!n)
-                return -ENOMEM;
+static void migrate_step(Hashmap *h, unsigned n) {
+        assert(h);
+        assert(h->old.ctrl);
 
-        /* Let's use a different randomized hash key for the
-         * extension, so that people cannot guess what we are using
-         * here forever */
-        get_hash_key(nkey, false);
+        for (; n > 0 && h->migrate_src < h->n_used; n--) {
+                unsigned src = h->migrate_src, dst = h->migrate_dst;
+                struct hashmap_entry *e = h->entries + src;
 
-        for (i = h->iterate_list_head; i; i = i->iterate_next) {
-                unsigned long old_bucket, new_bucket;
+                if (e->key != REMOVED) {
+                        if (src < h->migrate_end) {
+                                /* Leave it to make_room() to rebuild
+                                 * an index that filled up meanwhile */
+                                if (h->index.growth_left == 0)
+                                        return;
 
-                old_bucket = h->hash_ops->hash(i->key, h->hash_key) % h->n_buckets;
+                                index_link(h, e->hash, dst);
+                        } else
+                                h->index.slots[entry_slot(&h->index, e->hash, src)] = dst;
 
-                /* First, drop from old bucket table */
-                if (i->bucket_next)
-                        i->bucket_next->bucket_previous = i->bucket_previous;
+                        if (dst != src) {
+                                h->entries[dst] = *e;
+                                e->key = REMOVED;
+                        }
 
-                if (i->bucket_previous)
-                        i->bucket_previous->bucket_next = i->bucket_next;
-                else
-                        h->buckets[old_bucket] = i->bucket_next;
+                        if (h->first == src)
+                                h->first = dst;
 
-                /* Then, add to new backet table */
-                new_bucket = h->hash_ops->hash(i->key, nkey) % m;
+                        h->migrate_dst++;
+                }
 
-                i->bucket_next = n[new_bucket];
-                i->bucket_previous = NULL;
-                if (n[new_bucket])
-                        n[new_bucket]->bucket_previous = i;
-                n[new_bucket] = i;
+                h->migrate_src++;
         }
 
-        if (h->buckets != (struct hashmap_entry**) ((uint8_t*) h + ALIGN(sizeof(Hashmap))))
-                free(h->buckets);
+        if (h->migrate_src < h->n_used)
+                return;
 
-        h->buckets = n;
-        h->n_buckets = m;
+        /* The old index has nothing left that is not found through
+         * the new one */
+        index_free(&h->old);
+        h->n_used = h->migrate_dst;
+        h->first = MIN(h->first, h->n_used);
 
-        memcpy(h->hash_key, nkey, HASH_KEY_SIZE);
+        shrink_entries(h);
+}
 
-        return 1;
+static void migrate(Hashmap *h) {
+        if (h->old.ctrl)
+                migrate_step(h, MIGRATE_STEP);
 }
 
-static int __hashmap_put(Hashmap *h, const void *key, void *value, unsigned hash) {
-        /* For when we know no such entry exists yet */
+static int make_room(Hashmap *h, unsigned entries_add) {
+        unsigned new_n_entries, n_buckets;
 
-        struct hashmap_entry *e;
+        assert(h);
 
-        if (resize_buckets(h, 1) > 0)
-                hash = bucket_hash(h, key);
+        if (_likely_(h->n_allocated - h->n_used >= entries_add &&
+                     h->index.growth_left >= entries_add &&
+                     !h->rekey))
+                return 0;
 
-        e = new(struct hashmap_entry, 1);
+        new_n_entries = h->n_entries + entries_add;
 
-        if (!e)
+        /* overflow? */
+        if (_unlikely_(new_n_entries < entries_add || new_n_entries > UINT_MAX / 4))
                 return -ENOMEM;
 
-        e->key = key;
-        e->value = value;
+        /* Leave some room on top, so that a table filling up one
+         * entry at a time is not rebuilt every few insertions. If
+         * mostly holes were filling it, this just compacts it. */
+        n_buckets = buckets_for(new_n_entries + new_n_entries / 2 + migrate_slack(h));
+
+        /* A migration still in flight, or a key we no longer trust,
+         * is dealt with in one go */
+        if (h->old.ctrl || h->rekey)
+                return resize_buckets(h, n_buckets, h->rekey);
+
+        return migrate_start(h, n_buckets, entries_add);
+}
+
+static void maybe_shrink(Hashmap *h) {
+        assert(h);
+
+        if (h->n_entries == 0) {
+                /* Nothing left to probe past: give big tables back,
+                 * and let small ones start over */
+                if (h->index.n_buckets > GROUP_SIZE) {
+                        hashmap_clear(h);
+                        return;
+                }
+
+                index_free(&h->old);
+                if (h->index.ctrl) {
+                        memset(h->index.ctrl, CTRL_EMPTY, h->index.n_buckets);
+                        h->index.growth_left = CAPACITY(h->index.n_buckets);
+                }
+                h->n_used = h->first = 0;
+                return;
+        }
+
+        if (h->old.ctrl || h->index.n_buckets <= GROUP_SIZE)
+                return;
+
+        if (h->n_entries >= CAPACITY(h->index.n_buckets) / 8)
+                return;
+
+        /* Failing to shrink is harmless, we just keep the memory */
+        (void) migrate_start(h, buckets_for(h->n_entries * 2 + migrate_slack(h)), 0);
+}
+
+static int __hashmap_put(Hashmap *h, const void *key, void *value, unsigned long hash) {
+        /* For when we know no such entry exists yet */
+
+        int r;
 
-        link_entry(h, e, hash);
+        r = make_room(h, 1);
+        if (r < 0)
+                return r;
+        if (r > 0)
+                hash = bucket_hash(h, key);
+
+        link_entry(h, key, value, hash);
 
         return 1;
 }
 
-int hashmap_put(Hashmap *h, const void *key, void *value) {
-        struct hashmap_entry *e;
-        unsigned hash;
+/* The operations that hash or compare keys are written once here and
+ * instantiated by DEFINE_HASHMAP_OPS() below. Passing NULL for
+ * hash_func and compare_func calls them through the hash_ops of the
+ * hashmap; passing the functions themselves lets the compiler inline
+ * them into a copy specialised for one kind of key. */
+
+static _always_inline_ int base_put(Hashmap *h, const void *key, void *value, hash_func_t hash_func, compare_func_t compare_func) {
+        struct hashmap_index *x;
+        unsigned long hash;
+        unsigned s;
 
         assert(h);
 
-        hash = bucket_hash(h, key);
-        e = hash_scan(h, hash, key);
-        if (e) {
-                if (e->value == value)
+        migrate(h);
+
+        hash = key_hash(h, key, hash_func);
+        s = hash_scan(h, hash, key, &x, compare_func);
+        if (s != IDX_NIL) {
+                if (h->entries[x->slots[s]].value == value)
                         return 0;
                 return -EEXIST;
         }
@@ -417,103 +926,72 @@ int hashmap_put(Hashmap *h, const void *key, void *value) {
         return __hashmap_put(h, key, value, hash);
 }
 
-int hashmap_replace(Hashmap *h, const void *key, void *value) {
-        struct hashmap_entry *e;
-        unsigned hash;
+static _always_inline_ int base_replace(Hashmap *h, const void *key, void *value, hash_func_t hash_func, compare_func_t compare_func) {
+        struct hashmap_index *x;
+        unsigned long hash;
+        unsigned s;
 
         assert(h);
 
-        hash = bucket_hash(h, key);
-        e = hash_scan(h, hash, key);
-        if (e) {
-                e->key = key;
-                e->value = value;
+        migrate(h);
+
+        hash = key_hash(h, key, hash_func);
+        s = hash_scan(h, hash, key, &x, compare_func);
+        if (s != IDX_NIL) {
+                h->entries[x->slots[s]].key = key;
+                h->entries[x->slots[s]].value = value;
                 return 0;
         }
 
         return __hashmap_put(h, key, value, hash);
 }
 
-int hashmap_update(Hashmap *h, const void *key, void *value) {
-        struct hashmap_entry *e;
-        unsigned hash;
+static _always_inline_ int base_update(Hashmap *h, const void *key, void *value, hash_func_t hash_func, compare_func_t compare_func) {
+        struct hashmap_index *x;
+        unsigned s;
 
         assert(h);
 
-        hash = bucket_hash(h, key);
-        e = hash_scan(h, hash, key);
-        if (!e)
+        s = hash_scan(h, key_hash(h, key, hash_func), key, &x, compare_func);
+        if (s == IDX_NIL)
                 return -ENOENT;
 
-        e->value = value;
+        h->entries[x->slots[s]].value = value;
         return 0;
 }
 
-void* hashmap_get(Hashmap *h, const void *key) {
-        unsigned hash;
-        struct hashmap_entry *e;
-
-        if (!h)
-                return NULL;
-
-        hash = bucket_hash(h, key);
-        e = hash_scan(h, hash, key);
-        if (!e)
-                return NULL;
-
-        return e->value;
-}
-
-void* hashmap_get2(Hashmap *h, const void *key, void **key2) {
-        unsigned hash;
+static _always_inline_ void *base_get2(Hashmap *h, const void *key, void **key2, hash_func_t hash_func, compare_func_t compare_func) {
+        struct hashmap_index *x;
         struct hashmap_entry *e;
+        unsigned s;
 
         if (!h)
                 return NULL;
 
-        hash = bucket_hash(h, key);
-        e = hash_scan(h, hash, key);
-        if (!e)
+        s = hash_scan(h, key_hash(h, key, hash_func), key, &x, compare_func);
+        if (s == IDX_NIL)
                 return NULL;
 
+        e = h->entries + x->slots[s];
         if (key2)
                 *key2 = (void*) e->key;
 
         return e->value;
 }
 
-bool hashmap_contains(Hashmap *h, const void *key) {
-        unsigned hash;
+static _always_inline_ bool base_contains(Hashmap *h, const void *key, hash_func_t hash_func, compare_func_t compare_func) {
+        struct hashmap_index *x;
 
         if (!h)
                 return false;
 
-        hash = bucket_hash(h, key);
-        return !!hash_scan(h, hash, key);
+        return hash_scan(h, key_hash(h, key, hash_func), key, &x, compare_func) != IDX_NIL;
 }
 
-void* hashmap_remove(Hashmap *h, const void *key) {
+static _always_inline_ void *base_remove2(Hashmap *h, const void *key, void **rkey, hash_func_t hash_func, compare_func_t compare_func) {
+        struct hashmap_index *x;
         struct hashmap_entry *e;
-        unsigned hash;
-        void *data;
-
-        if (!h)
-                return NULL;
-
-        hash = bucket_hash(h, key);
-        e = hash_scan(h, hash, key);
-        if (!e)
-                return NULL;
-
-        data = e->value;
-        remove_entry(h, e);
-
-        return data;
-}
-
-void* hashmap_remove2(Hashmap *h, const void *key, void **rkey) {
-        struct hashmap_entry *e;
-        unsigned hash;
+        unsigned s;
         void *data;
 
         if (!h) {
@@ -522,100 +1000,176 @@ void* hashmap_remove2(Hashmap *h, const void *key, void **rkey) {
                 return NULL;
         }
 
-        hash = bucket_hash(h, key);
-        e = hash_scan(h, hash, key);
-        if (!e) {
+        migrate(h);
+
+        s = hash_scan(h, key_hash(h, key, hash_func), key, &x, compare_func);
+        if (s == IDX_NIL) {
                 if (rkey)
                         *rkey = NULL;
                 return NULL;
         }
 
+        e = h->entries + x->slots[s];
         data = e->value;
         if (rkey)
                 *rkey = (void*) e->key;
 
-        remove_entry(h, e);
+        unlink_slot(h, x, s);
+        maybe_shrink(h);
 
         return data;
 }
 
-int hashmap_remove_and_put(Hashmap *h, const void *old_key, const void *new_key, void *value) {
-        struct hashmap_entry *e;
-        unsigned old_hash, new_hash;
+static _always_inline_ void *base_remove_value(Hashmap *h, const void *key, void *value, hash_func_t hash_func, compare_func_t compare_func) {
+        struct hashmap_index *x;
+        unsigned s;
 
         if (!h)
-                return -ENOENT;
+                return NULL;
 
-        old_hash = bucket_hash(h, old_key);
-        e = hash_scan(h, old_hash, old_key);
-        if (!e)
-                return -ENOENT;
+        migrate(h);
 
-        new_hash = bucket_hash(h, new_key);
-        if (hash_scan(h, new_hash, new_key))
-                return -EEXIST;
+        s = hash_scan(h, key_hash(h, key, hash_func), key, &x, compare_func);
+        if (s == IDX_NIL)
+                return NULL;
 
-        unlink_entry(h, e, old_hash);
+        if (h->entries[x->slots[s]].value != value)
+                return NULL;
 
-        e->key = new_key;
-        e->value = value;
+        unlink_slot(h, x, s);
+        maybe_shrink(h);
 
-        link_entry(h, e, new_hash);
+        return value;
+}
 
-        return 0;
+static _always_inline_ void *base_next(Hashmap *h, const void *key, hash_func_t hash_func, compare_func_t compare_func) {
+        struct hashmap_index *x;
+        unsigned s, idx;
+
+        assert(key);
+
+        if (!h)
+                return NULL;
+
+        s = hash_scan(h, key_hash(h, key, hash_func), key, &x, compare_func);
+        if (s == IDX_NIL)
+                return NULL;
+
+        idx = next_entry(h, x->slots[s] + 1);
+        if (idx >= h->n_used)
+                return NULL;
+
+        return h->entries[idx].value;
 }
 
-int hashmap_remove_and_replace(Hashmap *h, const void *old_key, const void *new_key, void *value) {
-        struct hashmap_entry *e, *k;
-        unsigned old_hash, new_hash;
+#define DEFINE_HASHMAP_OPS(type, prefix, key_type, hash_func, compare_func) \
+        int prefix##_put(type *h, key_type key, void *value) {          \
+                return base_put((Hashmap*) h, key, value, hash_func, compare_func); \
+        }                                                               \
+        int prefix##_replace(type *h, key_type key, void *value) {      \
+                return base_replace((Hashmap*) h, key, value, hash_func, compare_func); \
+        }                                                               \
+        int prefix##_update(type *h, key_type key, void *value) {       \
+                return base_update((Hashmap*) h, key, value, hash_func, compare_func); \
+        }                                                               \
+        void *prefix##_get(type *h, key_type key) {                     \
+                return base_get2((Hashmap*) h, key, NULL, hash_func, compare_func); \
+        }                                                               \
+        void *prefix##_get2(type *h, key_type key, void **key2) {       \
+                return base_get2((Hashmap*) h, key, key2, hash_func, compare_func); \
+        }                                                               \
+        bool prefix##_contains(type *h, key_type key) {                 \
+                return base_contains((Hashmap*) h, key, hash_func, compare_func); \
+        }                                                               \
+        void *prefix##_remove(type *h, key_type key) {                  \
+                return base_remove2((Hashmap*) h, key, NULL, hash_func, compare_func); \
+        }                                                               \
+        void *prefix##_remove2(type *h, key_type key, void **rkey) {    \
+                return base_remove2((Hashmap*) h, key, rkey, hash_func, compare_func); \
+        }                                                               \
+        void *prefix##_remove_value(type *h, key_type key, void *value) { \
+                return base_remove_value((Hashmap*) h, key, value, hash_func, compare_func); \
+        }                                                               \
+        void *prefix##_next(type *h, key_type key) {                    \
+                return base_next((Hashmap*) h, key, hash_func, compare_func); \
+        }                                                               \
+        struct __useless_struct_to_allow_trailing_semicolon__
+
+#define DEFINE_HASHMAP_TYPE(type, prefix, key_type, hash_ops, hash_func, compare_func) \
+        type *prefix##_new(void) {                                      \
+                return (type*) hashmap_new(&hash_ops);                  \
+        }                                                               \
+        DEFINE_HASHMAP_OPS(type, prefix, key_type, hash_func, compare_func)
+
+DEFINE_HASHMAP_OPS(Hashmap, hashmap, const void *, NULL, NULL);
+DEFINE_HASHMAP_TYPE(StringHashmap, string_hashmap, const char *, string_hash_ops, string_hash_func, string_compare_func);
+DEFINE_HASHMAP_TYPE(Uint64Hashmap, uint64_hashmap, const uint64_t *, uint64_hash_ops, uint64_hash_func, uint64_compare_func);
+DEFINE_HASHMAP_TYPE(BusNameHashmap, bus_name_hashmap, const char *, trusted_string_hash_ops, trusted_string_hash_func, string_compare_func);
+
+int hashmap_remove_and_put(Hashmap *h, const void *old_key, const void *new_key, void *value) {
+        struct hashmap_index *x, *y;
+        unsigned long new_hash;
+        unsigned s;
+        int r;
 
         if (!h)
                 return -ENOENT;
 
-        old_hash = bucket_hash(h, old_key);
-        e = hash_scan(h, old_hash, old_key);
-        if (!e)
-                return -ENOENT;
+        migrate(h);
 
-        new_hash = bucket_hash(h, new_key);
-        k = hash_scan(h, new_hash, new_key);
-        if (k)
-                if (e != k)
-                        remove_entry(h, k);
+        /* Make room first, it may move everything around */
+        r = make_room(h, 1);
+        if (r < 0)
+                return r;
 
-        unlink_entry(h, e, old_hash);
+        s = hash_scan(h, bucket_hash(h, old_key), old_key, &x, NULL);
+        if (s == IDX_NIL)
+                return -ENOENT;
 
-        e->key = new_key;
-        e->value = value;
+        new_hash = bucket_hash(h, new_key);
+        if (hash_scan(h, new_hash, new_key, &y, NULL) != IDX_NIL)
+                return -EEXIST;
 
-        link_entry(h, e, new_hash);
+        unlink_slot(h, x, s);
+        link_entry(h, new_key, value, new_hash);
 
         return 0;
 }
 
-void* hashmap_remove_value(Hashmap *h, const void *key, void *value) {
-        struct hashmap_entry *e;
-        unsigned hash;
+int hashmap_remove_and_replace(Hashmap *h, const void *old_key, const void *new_key, void *value) {
+        struct hashmap_index *x, *y;
+        unsigned long new_hash;
+        unsigned s, k;
+        int r;
 
         if (!h)
-                return NULL;
+                return -ENOENT;
 
-        hash = bucket_hash(h, key);
+        migrate(h);
 
-        e = hash_scan(h, hash, key);
-        if (!e)
-                return NULL;
+        r = make_room(h, 1);
+        if (r < 0)
+                return r;
 
-        if (e->value != value)
-                return NULL;
+        s = hash_scan(h, bucket_hash(h, old_key), old_key, &x, NULL);
+        if (s == IDX_NIL)
+                return -ENOENT;
 
-        remove_entry(h, e);
+        new_hash = bucket_hash(h, new_key);
+        k = hash_scan(h, new_hash, new_key, &y, NULL);
+        if (k != IDX_NIL)
+                if (x->slots[s] != y->slots[k])
+                        unlink_slot(h, y, k);
 
-        return value;
+        unlink_slot(h, x, s);
+        link_entry(h, new_key, value, new_hash);
+
+        return 0;
 }
 
 void *hashmap_iterate(Hashmap *h, Iterator *i, const void **key) {
         struct hashmap_entry *e;
+        unsigned idx;
 
         assert(i);
 
@@ -625,15 +1179,14 @@ void *hashmap_iterate(Hashmap *h, Iterator *i, const void **key) {
         if (*i == ITERATOR_LAST)
                 goto at_end;
 
-        if (*i == ITERATOR_FIRST && !h->iterate_list_head)
+        /* The iterator holds the index of the next entry, plus one */
+        idx = *i == ITERATOR_FIRST ? h->first : (unsigned) ((uintptr_t) *i - 1);
+        idx = next_entry(h, idx);
+        if (idx >= h->n_used)
                 goto at_end;
 
-        e = *i == ITERATOR_FIRST ? h->iterate_list_head : (struct hashmap_entry*) *i;
-
-        if (e->iterate_next)
-                *i = (Iterator) e->iterate_next;
-        else
-                *i = ITERATOR_LAST;
+        e = h->entries + idx;
+        *i = (Iterator) (uintptr_t) (idx + 2);
 
         if (key)
                 *key = e->key;
@@ -654,10 +1207,10 @@ void* hashmap_first(Hashmap *h) {
         if (!h)
                 return NULL;
 
-        if (!h->iterate_list_head)
+        if (h->n_entries == 0)
                 return NULL;
 
-        return h->iterate_list_head->value;
+        return h->entries[h->first].value;
 }
 
 void* hashmap_first_key(Hashmap *h) {
@@ -665,10 +1218,10 @@ void* hashmap_first_key(Hashmap *h) {
         if (!h)
                 return NULL;
 
-        if (!h->iterate_list_head)
+        if (h->n_entries == 0)
                 return NULL;
 
-        return (void*) h->iterate_list_head->key;
+        return (void*) h->entries[h->first].key;
 }
 
 void* hashmap_steal_first(Hashmap *h) {
@@ -677,11 +1230,14 @@ void* hashmap_steal_first(Hashmap *h) {
         if (!h)
                 return NULL;
 
-        if (!h->iterate_list_head)
+        if (h->n_entries == 0)
                 return NULL;
 
-        data = h->iterate_list_head->value;
-        remove_entry(h, h->iterate_list_head);
+        migrate(h);
+
+        data = h->entries[h->first].value;
+        remove_entry(h, h->first);
+        maybe_shrink(h);
 
         return data;
 }
@@ -692,11 +1248,14 @@ void* hashmap_steal_first_key(Hashmap *h) {
         if (!h)
                 return NULL;
 
-        if (!h->iterate_list_head)
+        if (h->n_entries == 0)
                 return NULL;
 
-        key = (void*) h->iterate_list_head->key;
-        remove_entry(h, h->iterate_list_head);
+        migrate(h);
+
+        key = (void*) h->entries[h->first].key;
+        remove_entry(h, h->first);
+        maybe_shrink(h);
 
         return key;
 }
@@ -714,7 +1273,7 @@ unsigned hashmap_buckets(Hashmap *h) {
         if (!h)
                 return 0;
 
-        return h->n_buckets;
+        return h->index.n_buckets;
 }
 
 bool hashmap_isempty(Hashmap *h) {
@@ -726,16 +1285,20 @@ bool hashmap_isempty(Hashmap *h) {
 }
 
 int hashmap_merge(Hashmap *h, Hashmap *other) {
-        struct hashmap_entry *e;
+        unsigned idx;
 
         assert(h);
 
         if (!other)
                 return 0;
 
-        for (e = other->iterate_list_head; e; e = e->iterate_next) {
+        for (idx = other->first; idx < other->n_used; idx++) {
+                struct hashmap_entry *e = other->entries + idx;
                 int r;
 
+                if (e->key == REMOVED)
+                        continue;
+
                 r = hashmap_put(h, e->key, e->value);
                 if (r < 0 && r != -EEXIST)
                         return r;
@@ -749,7 +1312,7 @@ int hashmap_reserve(Hashmap *h, unsigned entries_add) {
 
         assert(h);
 
-        r = resize_buckets(h, entries_add);
+        r = make_room(h, entries_add);
         if (r < 0)
                 return r;
 
@@ -757,7 +1320,8 @@ int hashmap_reserve(Hashmap *h, unsigned entries_add) {
 }
 
 int hashmap_move(Hashmap *h, Hashmap *other) {
-        struct hashmap_entry *e, *n;
+        unsigned idx;
+        int r = 0;
 
         assert(h);
 
@@ -767,43 +1331,60 @@ int hashmap_move(Hashmap *h, Hashmap *other) {
         if (!other)
                 return 0;
 
-        for (e = other->iterate_list_head; e; e = n) {
-                unsigned h_hash, other_hash;
+        for (idx = other->first; idx < other->n_used; idx++) {
+                struct hashmap_entry *e = other->entries + idx;
+                struct hashmap_index *x;
+                unsigned long h_hash;
 
-                n = e->iterate_next;
+                if (e->key == REMOVED)
+                        continue;
 
                 h_hash = bucket_hash(h, e->key);
-                if (hash_scan(h, h_hash, e->key))
+                if (hash_scan(h, h_hash, e->key, &x, NULL) != IDX_NIL)
                         continue;
 
-                other_hash = bucket_hash(other, e->key);
-                unlink_entry(other, e, other_hash);
-                link_entry(h, e, h_hash);
+                r = __hashmap_put(h, e->key, e->value, h_hash);
+                if (r < 0)
+                        break;
+
+                remove_entry(other, idx);
+                r = 0;
         }
 
-        return 0;
+        maybe_shrink(other);
+
+        return r;
 }
 
 int hashmap_move_one(Hashmap *h, Hashmap *other, const void *key) {
-        unsigned h_hash, other_hash;
-        struct hashmap_entry *e;
+        struct hashmap_index *x;
+        unsigned long h_hash;
+        unsigned s;
+        int r;
 
         assert(h);
 
+        migrate(h);
+
         h_hash = bucket_hash(h, key);
-        if (hash_scan(h, h_hash, key))
+        if (hash_scan(h, h_hash, key, &x, NULL) != IDX_NIL)
                 return -EEXIST;
 
         if (!other)
                 return -ENOENT;
 
-        other_hash = bucket_hash(other, key);
-        e = hash_scan(other, other_hash, key);
-        if (!e)
+        migrate(other);
+
+        s = hash_scan(other, bucket_hash(other, key), key, &x, NULL);
+        if (s == IDX_NIL)
                 return -ENOENT;
 
-        unlink_entry(other, e, other_hash);
-        link_entry(h, e, h_hash);
+        r = __hashmap_put(h, key, other->entries[x->slots[s]].value, h_hash);
+        if (r < 0)
+                return r;
+
+        unlink_slot(other, x, s);
+        maybe_shrink(other);
 
         return 0;
 }
@@ -817,7 +1398,8 @@ Hashmap *hashmap_copy(Hashmap *h) {
         if (!copy)
                 return NULL;
 
-        if (hashmap_merge(copy, h) < 0) {
+        if (hashmap_reserve(copy, h->n_entries) < 0 ||
+            hashmap_merge(copy, h) < 0) {
                 hashmap_free(copy);
                 return NULL;
         }
@@ -842,24 +1424,3 @@ char **hashmap_get_strv(Hashmap *h) {
 
         return sv;
 }
-
-void *hashmap_next(Hashmap *h, const void *key) {
-        unsigned hash;
-        struct hashmap_entry *e;
-
-        assert(key);
-
-        if (!h)
-                return NULL;
-
-        hash = bucket_hash(h, key);
-        e = hash_scan(h, hash, key);
-        if (!e)
-                return NULL;
-
-        e = e->iterate_next;
-        if (!e)
-                return NULL;
-
-        return e->value;
-}
@@ -25,10 +25,14 @@
 
 #include "util.h"
 
-/* Pretty straightforward hash table implementation. As a minor
- * optimization a NULL hashmap object will be treated as empty hashmap
- * for all read operations. That way it is not necessary to
- * instantiate an object for each Hashmap use. */
+/* Open addressing hash table that keeps keys and values inline, see
+ * hashmap.c. As a minor optimization a NULL hashmap object will be
+ * treated as empty hashmap for all read operations. That way it is not
+ * necessary to instantiate an object for each Hashmap use.
+ *
+ * Iteration follows insertion order. Since any modification may move
+ * entries around while the table grows or shrinks, the hashmap must
+ * not be modified while iterating over it. */
 
 #define HASH_KEY_SIZE 16
 
@@ -43,8 +47,14 @@ typedef _IteratorStruct* Iterator;
 typedef unsigned long (*hash_func_t)(const void *p, const uint8_t hash_key[HASH_KEY_SIZE]);
 typedef int (*compare_func_t)(const void *a, const void *b);
 
+/* Optional, hashes up to HASH_MANY_MAX keys at once when the whole
+ * hashmap is rehashed. Must give the same results as hash. */
+#define HASH_MANY_MAX 64
+typedef void (*hash_many_func_t)(unsigned long hashes[], const void *const keys[], unsigned n, const uint8_t hash_key[HASH_KEY_SIZE]);
+
 struct hash_ops {
         hash_func_t hash;
+        hash_many_func_t hash_many;
         compare_func_t compare;
 };
 
@@ -52,6 +62,14 @@ unsigned long string_hash_func(const void *p, const uint8_t hash_key[HASH_KEY_SI
 int string_compare_func(const void *a, const void *b) _pure_;
 extern const struct hash_ops string_hash_ops;
 
+/* The trusted_* variant trades collision resistance for speed, and is
+ * only for keys that clients cannot influence at all, such as unique
+ * bus names assigned by the bus. A run of colliding keys still gets
+ * the hashmap rekeyed, but nothing stops an attacker from finding the
+ * next one. */
+unsigned long trusted_string_hash_func(const void *p, const uint8_t hash_key[HASH_KEY_SIZE]) _pure_;
+extern const struct hash_ops trusted_string_hash_ops;
+
 /* This will compare the passed pointers directly, and will not
  * dereference them. This is hence not useful for strings or
  * suchlike. */
@@ -239,3 +257,61 @@ DEFINE_TRIVIAL_CLEANUP_FUNC(OrderedHashmap*, ordered_hashmap_free_free_free);
 #define _cleanup_ordered_hashmap_free_ _cleanup_(ordered_hashmap_freep)
 #define _cleanup_ordered_hashmap_free_free_ _cleanup_(ordered_hashmap_free_freep)
 #define _cleanup_ordered_hashmap_free_free_free_ _cleanup_(ordered_hashmap_free_free_freep)
+
+/* Hashmaps for one kind of key. Underneath they are plain hashmaps
+ * with the matching hash_ops, but the operations that hash or compare
+ * keys have those functions inlined instead of calling them through
+ * struct hash_ops. */
+#define DECLARE_HASHMAP_TYPE(type, prefix, key_type)                    \
+        typedef struct type type;                                       \
+        type *prefix##_new(void);                                       \
+        int prefix##_put(type *h, key_type key, void *value);           \
+        int prefix##_replace(type *h, key_type key, void *value);       \
+        int prefix##_update(type *h, key_type key, void *value);        \
+        void *prefix##_get(type *h, key_type key);                      \
+        void *prefix##_get2(type *h, key_type key, void **key2);        \
+        bool prefix##_contains(type *h, key_type key);                  \
+        void *prefix##_remove(type *h, key_type key);                   \
+        void *prefix##_remove2(type *h, key_type key, void **rkey);     \
+        void *prefix##_remove_value(type *h, key_type key, void *value); \
+        void *prefix##_next(type *h, key_type key);                     \
+        static inline void prefix##_free(type *h) {                     \
+                hashmap_free((Hashmap*) h);                             \
+        }                                                               \
+        static inline void prefix##_clear(type *h) {                    \
+                hashmap_clear((Hashmap*) h);                            \
+        }                                                               \
+        static inline int prefix##_reserve(type *h, unsigned entries_add) { \
+                return hashmap_reserve((Hashmap*) h, entries_add);      \
+        }                                                               \
+        static inline unsigned prefix##_size(type *h) {                 \
+                return hashmap_size((Hashmap*) h);                      \
+        }                                                               \
+        static inline bool prefix##_isempty(type *h) {                  \
+                return hashmap_isempty((Hashmap*) h);                   \
+        }                                                               \
+        static inline void *prefix##_first(type *h) {                   \
+                return hashmap_first((Hashmap*) h);                     \
+        }                                                               \
+        static inline void *prefix##_steal_first(type *h) {             \
+                return hashmap_steal_first((Hashmap*) h);               \
+        }                                                               \
+        static inline void *prefix##_iterate(type *h, Iterator *i, key_type *key) { \
+                return hashmap_iterate((Hashmap*) h, i, (const void**) key); \
+        }                                                               \
+        DEFINE_TRIVIAL_CLEANUP_FUNC(type*, prefix##_free)
+
+DECLARE_HASHMAP_TYPE(StringHashmap, string_hashmap, const char *);
+DECLARE_HASHMAP_TYPE(Uint64Hashmap, uint64_hashmap, const uint64_t *);
+
+/* Keyed by unique bus names, hashed with trusted_string_hash_ops */
+DECLARE_HASHMAP_TYPE(BusNameHashmap, bus_name_hashmap, const char *);
+
+#define STRING_HASHMAP_FOREACH(e, h, i) \
+        for ((i) = ITERATOR_FIRST, (e) = string_hashmap_iterate((h), &(i), NULL); (e); (e) = string_hashmap_iterate((h), &(i), NULL))
+
+#define BUS_NAME_HASHMAP_FOREACH(e, h, i) \
+        for ((i) = ITERATOR_FIRST, (e) = bus_name_hashmap_iterate((h), &(i), NULL); (e); (e) = bus_name_hashmap_iterate((h), &(i), NULL))
+
+#define UINT64_HASHMAP_FOREACH(e, h, i) \
+        for ((i) = ITERATOR_FIRST, (e) = uint64_hashmap_iterate((h), &(i), NULL); (e); (e) = uint64_hashmap_iterate((h), &(i), NULL))
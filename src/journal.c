@@ -0,0 +1,764 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "hashmap.h"
+#include "siphash24.h"
+
+#define JOURNAL_MAGIC "UIDJRNL1"
+
+/* How long to leave the disk alone after a batch failed to commit */
+#define JOURNAL_RETRY_USEC (1000000ULL)
+
+typedef struct JournalHeader {
+        char magic[8];
+        uint64_t reserved;
+} JournalHeader;
+
+/* Records are padded to a multiple of 8 bytes, the checksum covers
+ * everything after itself including the padding. A handle, if any,
+ * follows the padded alias. */
+typedef struct JournalRecord {
+        uint64_t checksum;
+        uint32_t size;
+        uint32_t type;
+        uint64_t seqnum;
+        uint64_t start;
+        uint64_t len;
+        char alias[];
+} JournalRecord;
+
+assert_cc(sizeof(JournalHeader) == 16);
+assert_cc(sizeof(JournalRecord) == 40);
+
+typedef struct JournalCallback {
+        journal_commit_t callback;
+        void *userdata;
+} JournalCallback;
+
+typedef struct JournalBatch {
+        uint8_t *buf;
+        size_t size, allocated;
+
+        JournalCallback *callbacks;
+        unsigned n_callbacks, n_allocated;
+
+        uint64_t last_seqnum;
+} JournalBatch;
+
+struct Journal {
+        int fd;
+        char *path;
+        char *old_path;
+
+        /* Only ever touched from the event loop */
+        uint64_t seqnum;
+        bool rotate_pending;
+        /* Last record that made it to disk, the last one in the
+         * rotated file, and the newest one a snapshot has covered */
+        uint64_t written_seqnum;
+        uint64_t old_seqnum;
+        uint64_t covered_seqnum;
+        JournalBatch *open;
+        sd_event_source *post_source;
+        sd_event_source *done_source;
+        sd_event_source *retry_source;
+        bool retry_pending;
+        int done_fd;
+
+        /* Handed over to the writer thread under the lock */
+        pthread_t thread;
+        bool thread_started;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        JournalBatch *committing;
+        bool written;
+        int commit_error;
+        uint64_t offset;
+        bool quit;
+
+        JournalBatch batches[2];
+};
+
+static const uint8_t checksum_key[HASH_KEY_SIZE] = {};
+
+static uint64_t record_checksum(const JournalRecord *rec) {
+        uint64_t u;
+
+        siphash24((uint8_t*) &u, (const uint8_t*) rec + sizeof(rec->checksum), rec->size - sizeof(rec->checksum), checksum_key);
+        return u;
+}
+
+static int loop_pwrite(int fd, const void *buf, size_t nbytes, uint64_t offset) {
+        const uint8_t *p = buf;
+
+        while (nbytes > 0) {
+                ssize_t k;
+
+                k = pwrite(fd, p, nbytes, offset);
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
+                }
+                if (k == 0)
+                        return -EIO;
+
+                p += k;
+                offset += k;
+                nbytes -= k;
+        }
+
+        return 0;
+}
+
+static int fsync_parent(const char *path) {
+        char *p;
+        int fd, r = 0;
+
+        p = strdup(path);
+        if (!p)
+                return -ENOMEM;
+
+        fd = open(dirname(p), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        free(p);
+        if (fd < 0)
+                return -errno;
+
+        if (fsync(fd) < 0)
+                r = -errno;
+
+        close(fd);
+        return r;
+}
+
+static int journal_init_file(int fd) {
+        JournalHeader h = {};
+        int r;
+
+        memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+
+        if (ftruncate(fd, 0) < 0)
+                return -errno;
+
+        r = loop_pwrite(fd, &h, sizeof(h), 0);
+        if (r < 0)
+                return r;
+
+        if (fsync(fd) < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int journal_write_header(Journal *j) {
+        int r;
+
+        r = journal_init_file(j->fd);
+        if (r < 0)
+                return r;
+
+        j->offset = sizeof(JournalHeader);
+
+        return fsync_parent(j->path);
+}
+
+/* Moves the current file aside as <path>.old and continues in a fresh
+ * one. Only called while no batch is in flight, so the writer thread
+ * never sees the descriptor change under its feet. */
+static int journal_do_rotate(Journal *j) {
+        char *new_path;
+        int fd, r;
+
+        new_path = newa(char, strlen(j->path) + sizeof(".new"));
+        sprintf(new_path, "%s.new", j->path);
+
+        fd = open(new_path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+        if (fd < 0)
+                return -errno;
+
+        r = journal_init_file(fd);
+        if (r < 0)
+                goto fail;
+
+        if (rename(j->path, j->old_path) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        if (rename(new_path, j->path) < 0) {
+                r = -errno;
+                (void) rename(j->old_path, j->path);
+                goto fail;
+        }
+
+        close(j->fd);
+        j->fd = fd;
+        j->offset = sizeof(JournalHeader);
+        j->old_seqnum = j->written_seqnum;
+
+        return fsync_parent(j->path);
+
+fail:
+        unlink(new_path);
+        close(fd);
+        return r;
+}
+
+/* Called from the writer thread, and only ever from one thread at a
+ * time. A failed write is cut off again, so that no torn record can
+ * hide the ones written after it from the next replay. */
+static int journal_write(Journal *j, JournalBatch *b, uint64_t offset) {
+        int r;
+
+        r = loop_pwrite(j->fd, b->buf, b->size, offset);
+        if (r >= 0 && fdatasync(j->fd) < 0)
+                r = -errno;
+
+        if (r < 0 && ftruncate(j->fd, offset) < 0)
+                log_error("Failed to truncate journal after failed write: %s", strerror(errno));
+
+        return r;
+}
+
+static void *journal_writer(void *userdata) {
+        Journal *j = userdata;
+
+        pthread_mutex_lock(&j->lock);
+
+        for (;;) {
+                JournalBatch *b;
+                uint64_t offset;
+                int r;
+
+                while (!j->quit && (!j->committing || j->written))
+                        pthread_cond_wait(&j->cond, &j->lock);
+
+                if (!j->committing || j->written)
+                        break;
+
+                b = j->committing;
+                offset = j->offset;
+
+                pthread_mutex_unlock(&j->lock);
+                r = journal_write(j, b, offset);
+                pthread_mutex_lock(&j->lock);
+
+                j->commit_error = r;
+                j->written = true;
+
+                if (eventfd_write(j->done_fd, 1) < 0)
+                        log_error("Failed to wake up event loop: %s", strerror(errno));
+        }
+
+        pthread_mutex_unlock(&j->lock);
+        return NULL;
+}
+
+static void journal_batch_reset(JournalBatch *b) {
+        b->size = 0;
+        b->n_callbacks = 0;
+}
+
+static void journal_submit(Journal *j) {
+
+        /* Only one batch is in flight at any time, whatever comes in
+         * meanwhile piles up in the open batch and goes out with the
+         * next fdatasync() */
+
+        if (j->committing || j->retry_pending || j->open->size == 0)
+                return;
+
+        pthread_mutex_lock(&j->lock);
+        j->committing = j->open;
+        j->written = false;
+        j->open = j->open == &j->batches[0] ? &j->batches[1] : &j->batches[0];
+        pthread_cond_signal(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+}
+
+/* Puts the records of a batch that failed to commit in front of those
+ * appended since, so that they go out again with the next one in
+ * seqnum order. Whoever waited for them has been told already. */
+static int journal_requeue(Journal *j, JournalBatch *b) {
+        JournalBatch *o = j->open;
+
+        if (o->size + b->size > o->allocated) {
+                size_t n = MAX(o->allocated * 2, o->size + b->size);
+                uint8_t *t;
+
+                t = realloc(o->buf, n);
+                if (!t)
+                        return -ENOMEM;
+
+                o->buf = t;
+                o->allocated = n;
+        }
+
+        memmove(o->buf + b->size, o->buf, o->size);
+        memcpy(o->buf, b->buf, b->size);
+        if (o->size == 0)
+                o->last_seqnum = b->last_seqnum;
+        o->size += b->size;
+
+        return 0;
+}
+
+static void journal_arm_retry(Journal *j) {
+        uint64_t now;
+        int r;
+
+        r = sd_event_now(sd_event_source_get_event(j->retry_source), CLOCK_MONOTONIC, &now);
+        if (r >= 0)
+                r = sd_event_source_set_time(j->retry_source, now + JOURNAL_RETRY_USEC);
+        if (r >= 0)
+                r = sd_event_source_set_enabled(j->retry_source, SD_EVENT_ONESHOT);
+        if (r < 0) {
+                log_error("Failed to arm journal retry timer: %s", strerror(-r));
+                return;
+        }
+
+        j->retry_pending = true;
+}
+
+static int journal_on_retry(sd_event_source *s, uint64_t usec, void *userdata) {
+        Journal *j = userdata;
+
+        j->retry_pending = false;
+        journal_submit(j);
+        return 0;
+}
+
+static int journal_on_post(sd_event_source *s, void *userdata) {
+        journal_submit(userdata);
+        return 0;
+}
+
+static int journal_on_done(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        Journal *j = userdata;
+        JournalBatch *b;
+        eventfd_t v;
+        unsigned i;
+        int r;
+
+        if (eventfd_read(fd, &v) < 0)
+                return 0;
+
+        pthread_mutex_lock(&j->lock);
+        if (!j->committing || !j->written) {
+                pthread_mutex_unlock(&j->lock);
+                return 0;
+        }
+        b = j->committing;
+        r = j->commit_error;
+        if (r >= 0) {
+                j->offset += b->size;
+                j->written_seqnum = b->last_seqnum;
+        }
+        pthread_mutex_unlock(&j->lock);
+
+        if (r < 0)
+                log_error("Failed to write journal: %s", strerror(-r));
+
+        for (i = 0; i < b->n_callbacks; i++)
+                b->callbacks[i].callback(r, b->callbacks[i].userdata);
+
+        /* The callbacks undo what they waited for by appending more
+         * records, which only make sense on top of the failed ones,
+         * and a release nobody waited for must not get lost either */
+        if (r < 0) {
+                r = journal_requeue(j, b);
+                if (r < 0)
+                        log_error("Failed to keep unwritten journal records: %s", strerror(-r));
+
+                journal_arm_retry(j);
+        }
+
+        journal_batch_reset(b);
+
+        pthread_mutex_lock(&j->lock);
+        j->committing = NULL;
+        j->written = false;
+        pthread_mutex_unlock(&j->lock);
+
+        if (j->rotate_pending) {
+                j->rotate_pending = false;
+
+                r = journal_do_rotate(j);
+                if (r < 0)
+                        log_error("Failed to rotate journal: %s", strerror(-r));
+
+                /* The snapshot may have completed while we waited */
+                r = journal_drop_rotated(j, j->covered_seqnum);
+                if (r < 0)
+                        log_error("Failed to remove rotated journal: %s", strerror(-r));
+        }
+
+        journal_submit(j);
+        return 0;
+}
+
+int journal_open(const char *path, Journal **ret) {
+        Journal *j;
+
+        assert(path);
+        assert(ret);
+
+        j = new0(Journal, 1);
+        if (!j)
+                return -ENOMEM;
+
+        j->fd = j->done_fd = -1;
+        j->open = &j->batches[0];
+        pthread_mutex_init(&j->lock, NULL);
+        pthread_cond_init(&j->cond, NULL);
+
+        j->path = strdup(path);
+        j->old_path = malloc(strlen(path) + sizeof(".old"));
+        if (!j->path || !j->old_path) {
+                journal_close(j);
+                return -ENOMEM;
+        }
+        sprintf(j->old_path, "%s.old", path);
+
+        j->fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+        if (j->fd < 0) {
+                int r = -errno;
+
+                journal_close(j);
+                return r;
+        }
+
+        *ret = j;
+        return 0;
+}
+
+/* Feeds the records of one file to the callback and returns the offset
+ * behind the last good one, or 0 if not even the header is complete */
+static int journal_replay_fd(int fd, uint64_t since, journal_replay_t callback, void *userdata, uint64_t *seqnum, uint64_t *ret_offset) {
+        const JournalHeader *h;
+        struct stat st;
+        uint64_t offset;
+        uint8_t *p;
+        int r = 0;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if ((uint64_t) st.st_size < sizeof(JournalHeader)) {
+                *ret_offset = 0;
+                return 0;
+        }
+
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        h = (const JournalHeader*) p;
+        if (memcmp(h->magic, JOURNAL_MAGIC, sizeof(h->magic)) != 0) {
+                munmap(p, st.st_size);
+                return -EBADMSG;
+        }
+
+        for (offset = sizeof(JournalHeader); offset + sizeof(JournalRecord) <= (uint64_t) st.st_size; ) {
+                const JournalRecord *rec = (const JournalRecord*) (p + offset);
+
+                uint64_t handle = JOURNAL_NO_HANDLE;
+                size_t base;
+
+                if (rec->size < sizeof(JournalRecord) + 1 ||
+                    rec->size % 8 != 0 ||
+                    rec->size > st.st_size - offset ||
+                    rec->checksum != record_checksum(rec) ||
+                    !memchr(rec->alias, 0, rec->size - sizeof(JournalRecord)))
+                        break;
+
+                base = ALIGN8(sizeof(JournalRecord) + strlen(rec->alias) + 1);
+                if (rec->size >= base + sizeof(handle))
+                        memcpy(&handle, (const uint8_t*) rec + base, sizeof(handle));
+
+                /* Already part of the snapshot the caller started from */
+                if (rec->seqnum > since) {
+                        r = callback(rec->type, rec->start, rec->len, rec->alias[0] ? rec->alias : NULL, handle, userdata);
+                        if (r < 0)
+                                break;
+                }
+
+                *seqnum = rec->seqnum;
+                offset += rec->size;
+        }
+
+        munmap(p, st.st_size);
+        if (r < 0)
+                return r;
+
+        *ret_offset = offset;
+        return 0;
+}
+
+int journal_replay(Journal *j, uint64_t since, journal_replay_t callback, void *userdata) {
+        uint64_t offset;
+        struct stat st;
+        int fd, r;
+
+        assert(j);
+        assert(callback);
+
+        /* A file rotated away for a snapshot that never completed
+         * still holds records the current one depends on */
+        fd = open(j->old_path, O_RDONLY|O_CLOEXEC);
+        if (fd >= 0) {
+                r = journal_replay_fd(fd, since, callback, userdata, &j->seqnum, &offset);
+                close(fd);
+                if (r < 0)
+                        return r;
+
+                j->old_seqnum = j->seqnum;
+        } else if (errno != ENOENT)
+                return -errno;
+
+        r = journal_replay_fd(j->fd, since, callback, userdata, &j->seqnum, &offset);
+        if (r < 0)
+                return r;
+
+        j->seqnum = MAX(j->seqnum, since);
+        j->written_seqnum = j->seqnum;
+
+        /* Nothing was ever written beyond a possibly torn header */
+        if (offset == 0)
+                return journal_write_header(j);
+
+        if (fstat(j->fd, &st) < 0)
+                return -errno;
+
+        /* Whatever follows the last good record was never
+         * acknowledged to anybody, drop it */
+        if (offset < (uint64_t) st.st_size) {
+                log_error("Dropping %" PRIu64 " bytes of torn journal tail", (uint64_t) st.st_size - offset);
+
+                if (ftruncate(j->fd, offset) < 0 || fsync(j->fd) < 0)
+                        return -errno;
+        }
+
+        j->offset = offset;
+        return 0;
+}
+
+/* Drops all records, for once they are covered by a snapshot. Must not
+ * race with the writer, i.e. be called before journal_attach_event() */
+int journal_truncate(Journal *j) {
+        assert(j);
+        assert(!j->thread_started);
+
+        if (ftruncate(j->fd, sizeof(JournalHeader)) < 0 || fsync(j->fd) < 0)
+                return -errno;
+
+        j->offset = sizeof(JournalHeader);
+
+        return journal_drop_rotated(j, j->seqnum);
+}
+
+/* Starts a new file for everything appended from now on. If a batch
+ * is being written, that is only done once it is through, which is
+ * fine: the records in it are older than the request. */
+int journal_rotate(Journal *j) {
+        assert(j);
+
+        /* The previous one is still needed, keep appending here */
+        if (access(j->old_path, F_OK) >= 0)
+                return -EEXIST;
+
+        if (j->committing) {
+                j->rotate_pending = true;
+                return 0;
+        }
+
+        return journal_do_rotate(j);
+}
+
+/* Everything up to seqnum is covered by a durable snapshot, so the
+ * rotated file can go if it holds nothing newer. A rotation that is
+ * still waiting for the writer catches up on this once done. */
+int journal_drop_rotated(Journal *j, uint64_t seqnum) {
+        assert(j);
+
+        j->covered_seqnum = MAX(j->covered_seqnum, seqnum);
+
+        if (j->rotate_pending || j->old_seqnum > j->covered_seqnum)
+                return 0;
+
+        if (unlink(j->old_path) < 0) {
+                if (errno == ENOENT)
+                        return 0;
+                return -errno;
+        }
+
+        return fsync_parent(j->path);
+}
+
+uint64_t journal_size(Journal *j) {
+        assert(j);
+
+        return j->offset;
+}
+
+uint64_t journal_seqnum(Journal *j) {
+        assert(j);
+
+        return j->seqnum;
+}
+
+/* The last record that is on disk, everything after it may still be
+ * lost or fail */
+uint64_t journal_written_seqnum(Journal *j) {
+        assert(j);
+
+        return j->written_seqnum;
+}
+
+int journal_attach_event(Journal *j, sd_event *event) {
+        int r;
+
+        assert(j);
+        assert(event);
+
+        j->done_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (j->done_fd < 0)
+                return -errno;
+
+        r = sd_event_add_io(event, &j->done_source, j->done_fd, EPOLLIN, journal_on_done, j);
+        if (r < 0)
+                return r;
+
+        r = sd_event_add_post(event, &j->post_source, journal_on_post, j);
+        if (r < 0)
+                return r;
+
+        r = sd_event_add_time(event, &j->retry_source, CLOCK_MONOTONIC, 0, 0, journal_on_retry, j);
+        if (r >= 0)
+                r = sd_event_source_set_enabled(j->retry_source, SD_EVENT_OFF);
+        if (r < 0)
+                return r;
+
+        r = pthread_create(&j->thread, NULL, journal_writer, j);
+        if (r > 0)
+                return -r;
+        j->thread_started = true;
+
+        return 0;
+}
+
+int journal_append(Journal *j, JournalType type, uint64_t start, uint64_t len, const char *alias, uint64_t handle, journal_commit_t callback, void *userdata) {
+        JournalBatch *b;
+        JournalRecord *rec;
+        size_t l, base, size;
+
+        assert(j);
+
+        b = j->open;
+        l = alias ? strlen(alias) : 0;
+        base = size = ALIGN8(sizeof(JournalRecord) + l + 1);
+        if (handle != JOURNAL_NO_HANDLE)
+                size += sizeof(handle);
+
+        if (b->size + size > b->allocated) {
+                size_t n = MAX(b->allocated * 2, MAX(b->size + size, (size_t) 4096));
+                uint8_t *t;
+
+                t = realloc(b->buf, n);
+                if (!t)
+                        return -ENOMEM;
+
+                b->buf = t;
+                b->allocated = n;
+        }
+
+        if (callback && b->n_callbacks >= b->n_allocated) {
+                unsigned n = MAX(b->n_allocated * 2, 16U);
+                JournalCallback *t;
+
+                t = realloc(b->callbacks, n * sizeof(JournalCallback));
+                if (!t)
+                        return -ENOMEM;
+
+                b->callbacks = t;
+                b->n_allocated = n;
+        }
+
+        rec = (JournalRecord*) (b->buf + b->size);
+        memzero(rec, size);
+        rec->size = size;
+        rec->type = type;
+        rec->seqnum = b->last_seqnum = ++j->seqnum;
+        rec->start = start;
+        rec->len = len;
+        if (alias)
+                memcpy(rec->alias, alias, l);
+        if (handle != JOURNAL_NO_HANDLE)
+                memcpy((uint8_t*) rec + base, &handle, sizeof(handle));
+        rec->checksum = record_checksum(rec);
+
+        b->size += size;
+
+        if (callback) {
+                b->callbacks[b->n_callbacks].callback = callback;
+                b->callbacks[b->n_callbacks].userdata = userdata;
+                b->n_callbacks++;
+        }
+
+        return 0;
+}
+
+void journal_close(Journal *j) {
+        unsigned i;
+
+        if (!j)
+                return;
+
+        if (j->thread_started) {
+                pthread_mutex_lock(&j->lock);
+                j->quit = true;
+                pthread_cond_signal(&j->cond);
+                pthread_mutex_unlock(&j->lock);
+
+                pthread_join(j->thread, NULL);
+
+                if (j->committing && j->written && j->commit_error >= 0)
+                        j->offset += j->committing->size;
+        }
+
+        /* Nobody is left to wait for them, but don't lose records
+         * that made it into the open batch */
+        if (j->fd >= 0 && j->open->size > 0)
+                (void) journal_write(j, j->open, j->offset);
+
+        sd_event_source_unref(j->post_source);
+        sd_event_source_unref(j->done_source);
+        sd_event_source_unref(j->retry_source);
+
+        if (j->done_fd >= 0)
+                close(j->done_fd);
+        if (j->fd >= 0)
+                close(j->fd);
+
+        for (i = 0; i < ELEMENTSOF(j->batches); i++) {
+                free(j->batches[i].buf);
+                free(j->batches[i].callbacks);
+        }
+
+        pthread_cond_destroy(&j->cond);
+        pthread_mutex_destroy(&j->lock);
+
+        free(j->path);
+        free(j->old_path);
+        free(j);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <systemd/sd-event.h>
+
+#include "util.h"
+
+/* Append-only log of persistent lease changes. Records are collected
+ * for the duration of an event loop iteration and then written and
+ * synced as one batch by a writer thread, so durability costs one
+ * fdatasync() per iteration rather than one per lease, and the event
+ * loop itself never waits for the disk. */
+
+typedef struct Journal Journal;
+
+typedef enum JournalType {
+        JOURNAL_ALLOC = 1,
+        JOURNAL_RELEASE = 2,
+        JOURNAL_RESIZE = 3,
+} JournalType;
+
+/* Records may carry an opaque handle the caller wants back on replay */
+#define JOURNAL_NO_HANDLE UINT64_MAX
+
+typedef void (*journal_commit_t)(int error, void *userdata);
+typedef int (*journal_replay_t)(JournalType type, uint64_t start, uint64_t len, const char *alias, uint64_t handle, void *userdata);
+
+int journal_open(const char *path, Journal **ret);
+int journal_replay(Journal *j, uint64_t since, journal_replay_t callback, void *userdata);
+int journal_truncate(Journal *j);
+int journal_rotate(Journal *j);
+int journal_drop_rotated(Journal *j, uint64_t seqnum);
+uint64_t journal_seqnum(Journal *j) _pure_;
+uint64_t journal_written_seqnum(Journal *j) _pure_;
+uint64_t journal_size(Journal *j) _pure_;
+int journal_attach_event(Journal *j, sd_event *event);
+int journal_append(Journal *j, JournalType type, uint64_t start, uint64_t len, const char *alias, uint64_t handle, journal_commit_t callback, void *userdata);
+void journal_close(Journal *j);
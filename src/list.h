@@ -137,19 +137,23 @@
 #define LIST_MERGE_LIST(name, head_a, head_b)                           \
         do {                                                            \
                 typeof(*(head_a)) **_a = &(head_a), **_b = &(head_b),   \
-                        *_tail_a, *_head_b;                             \
+                        *_tail_a, *_head_b, *_tail_b;                   \
                 if (!*_a)                                               \
                         *_a = *_b;                                      \
                 else if (*_b) {                                         \
                         _tail_a = LIST_LAST(name, *_a);                 \
                         _head_b = LIST_FIRST(name, *_b);                \
+                        _tail_b = LIST_LAST(name, *_b);                 \
                                                                         \
                         _tail_a->name##_next = _head_b;               \
                         _head_b->name##_prev = _tail_a;               \
-                        (*_a)->name##_other_end = _head_b->name##_other_end; \
-                        (*_a)->name##_other_end->name##_other_end = *_a; \
-                        _tail_a->name##_other_end = NULL;             \
-                        _head_b->name##_other_end = NULL;             \
+                        /* Either may be the only item of its list */ \
+                        if (_tail_a != *_a)                             \
+                                _tail_a->name##_other_end = NULL;     \
+                        if (_head_b != _tail_b)                         \
+                                _head_b->name##_other_end = NULL;     \
+                        (*_a)->name##_other_end = _tail_b;            \
+                        _tail_b->name##_other_end = *_a;              \
                 }                                                       \
                                                                         \
                 *_b = NULL;                                             \
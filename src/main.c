@@ -1,277 +1,2722 @@
 
 #include <assert.h>
+#include <errno.h>
 #include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <systemd/sd-bus-vtable.h>
+#include <systemd/sd-daemon.h>
 #include "list.h"
 #include "util.h"
 #include "hashmap.h"
+#include "pool.h"
+#include "journal.h"
+#include "snapshot.h"
+
+#define LEASE_ANYWHERE ((uint64_t) -1)
+
+static const struct pool_ops *pool = &buddy_pool_ops;
+static const char *arg_state_dir;
+/* Where persistent leases and snapshots go, NULL if nowhere */
+static char *state_dir;
+static uint64_t arg_quarantine_usec;
+static Journal *journal;
+
+/* A snapshot is taken once the journal grows past this, or at the
+ * latest after the interval if anything was journaled at all */
+#define SNAPSHOT_JOURNAL_SIZE (64ULL * 1024ULL * 1024ULL)
+#define SNAPSHOT_INTERVAL_USEC (3600ULL * 1000000ULL)
+
+static sd_event_source *snapshot_child_source;
+static uint64_t snapshot_last_seqnum;
+static uint64_t snapshot_child_seqnum;
+static bool snapshot_backoff;
+
+#define STASH_FDNAME "state"
+#define LEASE_FDNAME_PREFIX "lease-"
+#define LEASE_FDNAME_MAX (sizeof(LEASE_FDNAME_PREFIX) + 16)
+
+int alloc_chunk(uint64_t start, uint64_t size, Chunk *ret) {
+        int r;
+
+        if (size == 0)
+                return -EINVAL;
+
+        if (start == LEASE_ANYWHERE)
+                r = pool->alloc(size, ret);
+        else
+                r = pool->claim(start, size, ret);
+        if (r < 0)
+                return r;
+
+        printf(" allocated chunk : start: %" PRIu64 " size: %u (%" PRIu64 ") requested: %" PRIu64 "\n", ret->start, ret->size, ret->len, size);
+        return 0;
+}
+
+void free_chunk(Chunk *c) {
+        printf(" freeing chunk : start: %" PRIu64 " size: %u (%" PRIu64 ")\n", c->start, c->size, c->len);
+
+        pool->free(c);
+}
+
+#define LEASE_PATH_PREFIX "/be/enospc/uidallocd/leases/"
+#define ALIAS_PATH_PREFIX "/be/enospc/uidallocd/aliases/"
+#define LEASE_HANDLE_MAX sizeof("xxxxxxxx_xxxxxxxx")
+#define LEASE_PATH_MAX (sizeof(LEASE_PATH_PREFIX) + LEASE_HANDLE_MAX)
+
+/* How leases are named in messages */
+#define LEASE_FMT "%02x_%016" PRIx64
+#define LEASE_FMT_ARGS(lease) (lease)->chunk.size, (lease)->chunk.start
+
+#define BUS_ERROR_ALIAS_EXISTS "be.enospc.uidallocd.AliasExists"
+#define BUS_ERROR_TOO_LARGE "be.enospc.uidallocd.TooLarge"
+#define BUS_ERROR_NO_SPACE "be.enospc.uidallocd.NoSpace"
+#define BUS_ERROR_RANGE_BUSY "be.enospc.uidallocd.RangeBusy"
+#define BUS_ERROR_INVALID_RANGE "be.enospc.uidallocd.InvalidRange"
+
+typedef struct Lease Lease;
+typedef struct Owner Owner;
+
+struct Lease {
+        Chunk chunk;
+
+        /* Points to the copy at the end of the lease, or NULL */
+        char *alias;
+
+        /* Where in the handle table the lease is reachable from the bus */
+        uint32_t slot;
+        uint32_t generation;
+
+        uint32_t persistent;
+        bool committing;
+
+        /* Released, but held back for the alias to claim again */
+        bool quarantined;
+        uint64_t quarantine_until;
+        LIST_FIELDS(Lease, quarantine);
+
+        /* While committing, the length the journal has on disk, 0 if
+         * not even the allocation is there yet */
+        uint64_t committed_len;
+
+        /* Given back unless renewed within ttl usec, 0 for never. Due
+         * leases wait on the expired list, linked through the same
+         * fields, until they are reclaimed. */
+        uint64_t ttl;
+        uint64_t expire_tick;
+        uint8_t wheel_level;
+        uint8_t wheel_slot;
+        LIST_FIELDS(Lease, wheel);
+
+        /* The bus client a volatile lease goes away with */
+        Owner *owner;
+        LIST_FIELDS(Lease, owned);
+
+        /* Our end of the socket pair handed out with the lease, which
+         * goes away once every copy of the other end is closed */
+        sd_event_source *fd_source;
+        /* Restored from a stash that said it had one, until our
+         * predecessor hands it over */
+        bool awaiting_fd;
+
+        char alias_buf[];
+};
+
+/* A client holding volatile leases, watched for disconnecting for as
+ * long as it has any */
+struct Owner {
+        char *name;
+        sd_bus_slot *match;
+        sd_bus_slot *check;
+        bool gone;
+        LIST_HEAD(Lease) leases;
+};
+
+Uint64Hashmap *leasemap;
+StringHashmap *aliasmap;
+BusNameHashmap *ownermap;
+
+/* The object path of a lease names a slot in this table and the
+ * generation the slot was at when the lease got it, so finding the
+ * lease behind a path is an array index. Freeing a slot bumps its
+ * generation, which makes stale paths miss. */
+typedef struct LeaseSlot {
+        Lease *lease;
+        uint32_t generation;
+        uint32_t next_free;
+} LeaseSlot;
+
+#define SLOT_NONE UINT32_MAX
+
+static struct {
+        LeaseSlot *slots;
+        uint32_t n_slots;
+        uint32_t n_allocated;
+        uint32_t free;
+        /* New slots start here, so that paths handed out by a previous
+         * instance are unlikely to hit anything */
+        uint32_t seed;
+        /* While leases come back from disk, freed slots are not reused,
+         * since a later one may still claim them */
+        bool restoring;
+} handles = {
+        .free = SLOT_NONE,
+        .restoring = true,
+};
+
+/* Oldest first, they all get the same grace period */
+static LIST_HEAD(Lease) quarantine;
+static unsigned n_quarantined;
+static sd_event_source *quarantine_source;
+
+/* Quarantined chunks by floor(log2(length)), with bit n of the mask
+ * set while class n is non-empty, so that CanAllocate can tell
+ * whether eviction would make room without walking the list */
+static unsigned quarantine_classes[64];
+static uint64_t quarantine_mask;
+
+static unsigned chunk_class(uint64_t len) {
+        assert(len > 0);
+        return 63 - __builtin_clzll(len);
+}
+
+static void quarantine_account(const Chunk *chunk, bool add) {
+        unsigned c = chunk_class(chunk->len);
+
+        if (add) {
+                quarantine_classes[c]++;
+                quarantine_mask |= UINT64_C(1) << c;
+        } else {
+                assert(quarantine_classes[c] > 0);
+                if (--quarantine_classes[c] == 0)
+                        quarantine_mask &= ~(UINT64_C(1) << c);
+        }
+}
+
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+static void quarantine_arm(void) {
+        int r;
+
+        if (!quarantine_source)
+                return;
+
+        if (!quarantine) {
+                r = sd_event_source_set_enabled(quarantine_source, SD_EVENT_OFF);
+                if (r < 0)
+                        log_error("Failed to disable quarantine timer: %s", strerror(-r));
+                return;
+        }
+
+        r = sd_event_source_set_time(quarantine_source, quarantine->quarantine_until);
+        if (r >= 0)
+                r = sd_event_source_set_enabled(quarantine_source, SD_EVENT_ONESHOT);
+        if (r < 0)
+                log_error("Failed to arm quarantine timer: %s", strerror(-r));
+}
+
+static void quarantine_unlink(Lease *lease) {
+        bool first = lease == quarantine;
+
+        LIST_REMOVE(quarantine, quarantine, lease);
+        lease->quarantined = false;
+        n_quarantined--;
+        quarantine_account(&lease->chunk, false);
+
+        if (first)
+                quarantine_arm();
+}
+
+/* Leases with a ttl sit on a hierarchical timer wheel: level l has
+ * WHEEL_SIZE slots of WHEEL_SIZE^l ticks each, and whatever is in the
+ * current slot of a level is pushed down one level whenever the level
+ * below wraps around. Scheduling and cancelling are O(1), a tick only
+ * looks at one slot per level, and the occupied bitmaps let the timer
+ * sleep through stretches in which nothing is due. */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1U << WHEEL_BITS)
+#define WHEEL_MASK ((uint64_t) WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_TICK_USEC 1000000ULL
+
+/* Reclaimed per idle dispatch, so a mass expiry cannot starve the bus */
+#define EXPIRE_BATCH 256
+
+assert_cc(WHEEL_SIZE <= 64);
+
+static struct {
+        /* The next tick to run, all before it are done */
+        uint64_t now;
+        uint64_t occupied[WHEEL_LEVELS];
+        LIST_HEAD(Lease) slots[WHEEL_LEVELS][WHEEL_SIZE];
+} wheel;
+
+static LIST_HEAD(Lease) expired;
+static sd_event_source *wheel_source;
+static sd_event_source *expire_source;
+
+static uint64_t usec_to_tick(uint64_t usec) {
+        return usec / WHEEL_TICK_USEC + !!(usec % WHEEL_TICK_USEC);
+}
+
+static void wheel_insert(Lease *lease) {
+        uint64_t expire, delta;
+        unsigned l, idx;
+
+        if (lease->expire_tick < wheel.now)
+                lease->expire_tick = wheel.now;
+
+        /* Anything beyond the top level waits in its last slot and is
+         * put back there until it comes into reach */
+        expire = MIN(lease->expire_tick, wheel.now + WHEEL_SPAN - 1);
+        delta = expire - wheel.now;
+
+        for (l = 0; l < WHEEL_LEVELS - 1; l++)
+                if (delta >> (WHEEL_BITS * (l + 1)) == 0)
+                        break;
+
+        idx = (expire >> (WHEEL_BITS * l)) & WHEEL_MASK;
+        LIST_PREPEND(wheel, wheel.slots[l][idx], lease);
+        wheel.occupied[l] |= 1ULL << idx;
+
+        lease->wheel_level = l;
+        lease->wheel_slot = idx;
+}
+
+static void wheel_remove(Lease *lease) {
+        unsigned l = lease->wheel_level, idx = lease->wheel_slot;
+
+        LIST_REMOVE(wheel, wheel.slots[l][idx], lease);
+        if (!wheel.slots[l][idx])
+                wheel.occupied[l] &= ~(1ULL << idx);
+}
+
+static bool wheel_empty(void) {
+        unsigned l;
+
+        for (l = 0; l < WHEEL_LEVELS; l++)
+                if (wheel.occupied[l])
+                        return false;
+
+        return true;
+}
+
+/* Moves the current slot of every level that wrapped one level down */
+static void wheel_cascade(void) {
+        unsigned l;
+
+        for (l = 1; l < WHEEL_LEVELS; l++) {
+                unsigned idx = (wheel.now >> (WHEEL_BITS * l)) & WHEEL_MASK;
+                LIST_HEAD(Lease) list = wheel.slots[l][idx];
+                Lease *lease;
+
+                wheel.slots[l][idx] = NULL;
+                wheel.occupied[l] &= ~(1ULL << idx);
+
+                while ((lease = LIST_STEAL_FIRST(wheel, list)))
+                        wheel_insert(lease);
+
+                if (idx != 0)
+                        break;
+        }
+}
+
+/* Runs all ticks up to and including target, everything due ends up
+ * on the expired list */
+static void wheel_advance(uint64_t target) {
+        while (wheel.now <= target) {
+                unsigned idx = wheel.now & WHEEL_MASK;
+
+                if (idx == 0)
+                        wheel_cascade();
+
+                if (wheel.occupied[0] & (1ULL << idx)) {
+                        LIST_MERGE_LIST(wheel, expired, wheel.slots[0][idx]);
+                        wheel.occupied[0] &= ~(1ULL << idx);
+                }
+
+                wheel.now++;
+
+                /* Only a cascade can bring anything down to level 0 */
+                if (!wheel.occupied[0])
+                        wheel.now = MIN(target + 1, (wheel.now + WHEEL_MASK) & ~WHEEL_MASK);
+        }
+}
+
+/* The first tick at which the wheel has anything to do */
+static uint64_t wheel_next(void) {
+        unsigned idx = wheel.now & WHEEL_MASK, l;
+        uint64_t m = wheel.occupied[0];
+
+        if (m) {
+                if (idx > 0)
+                        m = (m >> idx) | (m << (WHEEL_SIZE - idx));
+                return wheel.now + __builtin_ctzll(m);
+        }
+
+        for (l = 1; l < WHEEL_LEVELS; l++)
+                if (wheel.occupied[l]) {
+                        uint64_t step = 1ULL << (WHEEL_BITS * l);
+
+                        return (wheel.now + step - 1) & ~(step - 1);
+                }
+
+        return UINT64_MAX;
+}
+
+static void wheel_arm(void) {
+        uint64_t next;
+        int r;
+
+        if (!wheel_source)
+                return;
+
+        next = wheel_next();
+        if (next == UINT64_MAX) {
+                r = sd_event_source_set_enabled(wheel_source, SD_EVENT_OFF);
+                if (r < 0)
+                        log_error("Failed to disable expiry timer: %s", strerror(-r));
+                return;
+        }
+
+        r = sd_event_source_set_time(wheel_source, next * WHEEL_TICK_USEC);
+        if (r >= 0)
+                r = sd_event_source_set_enabled(wheel_source, SD_EVENT_ONESHOT);
+        if (r < 0)
+                log_error("Failed to arm expiry timer: %s", strerror(-r));
+}
+
+static void expire_arm(void) {
+        int r;
+
+        if (!expire_source)
+                return;
+
+        r = sd_event_source_set_enabled(expire_source, expired ? SD_EVENT_ONESHOT : SD_EVENT_OFF);
+        if (r < 0)
+                log_error("Failed to arm expiry: %s", strerror(-r));
+}
+
+static void lease_unschedule(Lease *lease) {
+        if (lease->ttl == 0)
+                return;
+
+        /* Whatever is still on the wheel is due at the current tick
+         * or later, the expired list only has what is past */
+        if (lease->expire_tick < wheel.now)
+                LIST_REMOVE(wheel, expired, lease);
+        else
+                wheel_remove(lease);
+
+        lease->ttl = 0;
+}
+
+/* Makes the lease expire usec from now unless renewed, after which
+ * every renewal buys it another ttl. The caller arms the timer. */
+static void lease_schedule(Lease *lease, uint64_t ttl, uint64_t usec) {
+        uint64_t now;
+
+        lease_unschedule(lease);
+        if (ttl == 0)
+                return;
+
+        now = now_usec();
+
+        /* Nothing to catch up on, skip the ticks that passed while
+         * the wheel was idle */
+        if (wheel_empty())
+                wheel.now = MAX(wheel.now, now / WHEEL_TICK_USEC);
+
+        lease->ttl = ttl;
+        lease->expire_tick = usec_to_tick(now + MIN(usec, UINT64_MAX - now));
+        wheel_insert(lease);
+}
+
+static void owner_free(Owner *o) {
+        bus_name_hashmap_remove_value(ownermap, o->name, o);
+
+        sd_bus_slot_unref(o->match);
+        sd_bus_slot_unref(o->check);
+        free(o->name);
+        free(o);
+}
+
+static void lease_disown(Lease *lease) {
+        Owner *o = lease->owner;
+
+        if (!o)
+                return;
+
+        LIST_REMOVE(owned, o->leases, lease);
+        lease->owner = NULL;
+
+        if (!o->leases)
+                owner_free(o);
+}
+
+static void lease_unwatch(Lease *lease) {
+        lease->fd_source = sd_event_source_unref(lease->fd_source);
+}
+
+/* New slots are free, but not on the free list */
+static int lease_handles_grow(uint32_t n_slots) {
+        if (n_slots > handles.n_allocated) {
+                uint32_t n;
+                LeaseSlot *t;
+
+                if (n_slots >= SLOT_NONE / 2)
+                        return -ENOSPC;
+
+                n = MAX(MAX(handles.n_allocated * 2, n_slots), 64U);
+                t = realloc(handles.slots, n * sizeof(LeaseSlot));
+                if (!t)
+                        return -ENOMEM;
+
+                handles.slots = t;
+                handles.n_allocated = n;
+        }
+
+        for (; handles.n_slots < n_slots; handles.n_slots++) {
+                handles.slots[handles.n_slots].lease = NULL;
+                handles.slots[handles.n_slots].generation = handles.seed;
+        }
+
+        return 0;
+}
+
+static int lease_handle_new(Lease *lease) {
+        LeaseSlot *slot;
+        uint32_t idx;
+
+        if (handles.free != SLOT_NONE) {
+                idx = handles.free;
+                handles.free = handles.slots[idx].next_free;
+        } else {
+                int r;
+
+                r = lease_handles_grow(handles.n_slots + 1);
+                if (r < 0)
+                        return r;
+
+                idx = handles.n_slots - 1;
+        }
+
+        slot = &handles.slots[idx];
+        slot->lease = lease;
+
+        lease->slot = idx;
+        lease->generation = slot->generation;
+
+        return 0;
+}
+
+static void lease_handle_free(Lease *lease) {
+        LeaseSlot *slot;
+
+        if (lease->slot >= handles.n_slots || handles.slots[lease->slot].lease != lease)
+                return;
+
+        slot = &handles.slots[lease->slot];
+        slot->lease = NULL;
+        slot->generation++;
+
+        if (handles.restoring)
+                return;
+
+        slot->next_free = handles.free;
+        handles.free = lease->slot;
+}
+
+/* Moves a lease that was just restored to the slot it had before, so
+ * that its object path stays the same */
+static int lease_handle_claim(Lease *lease, uint32_t idx, uint32_t generation) {
+        int r;
+
+        assert(handles.restoring);
+
+        if (idx != lease->slot) {
+                r = lease_handles_grow(MAX(handles.n_slots, idx + 1));
+                if (r < 0)
+                        return r;
+
+                if (handles.slots[idx].lease)
+                        return -EEXIST;
+
+                /* Hand back the slot it was given meanwhile, for good
+                 * if it was the last one */
+                if (lease->slot == handles.n_slots - 1) {
+                        handles.slots[lease->slot].lease = NULL;
+                        handles.n_slots--;
+                } else
+                        lease_handle_free(lease);
+        }
+
+        handles.slots[idx].lease = lease;
+        handles.slots[idx].generation = generation;
+        lease->slot = idx;
+        lease->generation = generation;
+
+        return 0;
+}
+
+/* Ends restoring, every slot left without a lease becomes free */
+static void lease_handles_restored(void) {
+        uint32_t idx;
+
+        handles.restoring = false;
+        handles.free = SLOT_NONE;
+
+        for (idx = handles.n_slots; idx > 0; idx--)
+                if (!handles.slots[idx - 1].lease) {
+                        handles.slots[idx - 1].next_free = handles.free;
+                        handles.free = idx - 1;
+                }
+}
+
+static uint64_t lease_handle_pack(Lease *lease) {
+        return (uint64_t) lease->slot << 32 | lease->generation;
+}
+
+static int unhexchar(char c) {
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+
+        return -EINVAL;
+}
+
+static Lease *lease_handle_find(const char *handle) {
+        uint32_t v[2] = {};
+        unsigned i, j;
+        LeaseSlot *slot;
+
+        /* Exactly two times eight lowercase hex digits */
+        for (i = 0; i < 2; i++) {
+                for (j = 0; j < 8; j++) {
+                        int x = unhexchar(*(handle++));
+
+                        if (x < 0)
+                                return NULL;
+                        v[i] = v[i] << 4 | x;
+                }
+
+                if (*(handle++) != (i == 0 ? '_' : 0))
+                        return NULL;
+        }
+
+        if (v[0] >= handles.n_slots)
+                return NULL;
+
+        slot = &handles.slots[v[0]];
+        if (slot->generation != v[1])
+                return NULL;
+
+        return slot->lease;
+}
+
+static char *lease_format_handle(Lease *lease, char handle[LEASE_HANDLE_MAX]) {
+        snprintf(handle, LEASE_HANDLE_MAX, "%08" PRIx32 "_%08" PRIx32, lease->slot, lease->generation);
+        return handle;
+}
+
+static void lease_free(Lease *lease) {
+        if (!lease)
+                return;
+
+        if (lease->quarantined)
+                quarantine_unlink(lease);
+        lease_unschedule(lease);
+        lease_disown(lease);
+        lease_unwatch(lease);
+
+        lease_handle_free(lease);
+
+        uint64_hashmap_remove_value(leasemap, &lease->chunk.start, lease);
+        if (lease->alias)
+                string_hashmap_remove_value(aliasmap, lease->alias, lease);
+
+        free(lease);
+}
+
+static void lease_log_release(Lease *lease) {
+        int r;
+
+        /* Nobody waits for this to hit the disk: should we crash
+         * before, the lease merely comes back */
+        if (lease->persistent && journal) {
+                r = journal_append(journal, JOURNAL_RELEASE, lease->chunk.start, lease->chunk.len, NULL, JOURNAL_NO_HANDLE, NULL, NULL);
+                if (r < 0)
+                        log_error("Failed to log release of " LEASE_FMT ": %s", LEASE_FMT_ARGS(lease), strerror(-r));
+        }
+}
+
+static void lease_release(Lease *lease) {
+        printf("releaseing: " LEASE_FMT "\n", LEASE_FMT_ARGS(lease));
+
+        lease_log_release(lease);
+
+        free_chunk(&lease->chunk);
+        lease_free(lease);
+}
+
+static void lease_quarantine(Lease *lease, uint64_t until) {
+        Lease *i;
+
+        assert(lease->alias);
+        assert(!lease->quarantined);
+
+        uint64_hashmap_remove_value(leasemap, &lease->chunk.start, lease);
+        lease_handle_free(lease);
+        lease_unschedule(lease);
+        lease_disown(lease);
+        lease_unwatch(lease);
+
+        lease->quarantined = true;
+        lease->quarantine_until = until;
+        lease->persistent = false;
+
+        /* Usually the newest deadline, but a rolled back revival brings
+         * its old one along */
+        LIST_FOREACH_REVERSE(quarantine, i, quarantine)
+                if (i->quarantine_until <= until)
+                        break;
+        if (i)
+                LIST_INSERT_AFTER(quarantine, quarantine, i, lease);
+        else
+                LIST_PREPEND(quarantine, quarantine, lease);
+        n_quarantined++;
+        quarantine_account(&lease->chunk, true);
+
+        if (lease == quarantine)
+                quarantine_arm();
+}
+
+/* Gives up a lease on behalf of its owner. With a quarantine period
+ * set, an aliased range stays reserved for a while instead, so that a
+ * restarting owner can get the very same uids back. */
+static void lease_retire(Lease *lease) {
+        if (arg_quarantine_usec == 0 || !lease->alias) {
+                lease_release(lease);
+                return;
+        }
+
+        printf("quarantining: " LEASE_FMT "\n", LEASE_FMT_ARGS(lease));
+
+        lease_log_release(lease);
+        lease_quarantine(lease, now_usec() + arg_quarantine_usec);
+}
+
+/* Takes back a lease handed out by a call that failed after all. One
+ * revived from quarantine goes back there with its old deadline. */
+static void lease_rollback(Lease *lease) {
+        if (lease->quarantine_until == 0) {
+                lease_release(lease);
+                return;
+        }
+
+        printf("requarantining: " LEASE_FMT "\n", LEASE_FMT_ARGS(lease));
+
+        lease_log_release(lease);
+        lease_quarantine(lease, lease->quarantine_until);
+}
+
+static void lease_evict(Lease *lease) {
+        assert(lease->quarantined);
+
+        printf("evicting: " LEASE_FMT "\n", LEASE_FMT_ARGS(lease));
+
+        free_chunk(&lease->chunk);
+        lease_free(lease);
+}
+
+/* Makes room for an allocation that failed by giving up quarantined
+ * ranges: the oldest one if any place will do, or all that are in the
+ * way of a specific range. Returns whether anything was freed. */
+static bool quarantine_evict(uint64_t start, uint64_t size) {
+        Lease *lease, *next;
+        bool evicted = false;
+        uint64_t len;
+
+        if (start == LEASE_ANYWHERE) {
+                if (!quarantine)
+                        return false;
+
+                lease_evict(quarantine);
+                return true;
+        }
+
+        /* What the pool would actually claim for the request */
+        len = pool->chunk_len(size);
+
+        LIST_FOREACH_SAFE(quarantine, lease, next, quarantine)
+                if (lease->chunk.start < start + len && start < lease->chunk.start + lease->chunk.len) {
+                        lease_evict(lease);
+                        evicted = true;
+                }
+
+        return evicted;
+}
+
+static int lease_revive(Lease *lease, bool persistent, Lease **ret) {
+        int r;
+
+        quarantine_unlink(lease);
+
+        r = lease_handle_new(lease);
+        if (r >= 0)
+                r = uint64_hashmap_put(leasemap, &lease->chunk.start, lease);
+        if (r < 0) {
+                lease_quarantine(lease, lease->quarantine_until);
+                return r;
+        }
+
+        printf("reviving: " LEASE_FMT "\n", LEASE_FMT_ARGS(lease));
+
+        lease->persistent = persistent;
+
+        *ret = lease;
+        return 0;
+}
+
+/* Wraps an already allocated chunk in a lease, on failure the chunk
+ * goes back to the pool */
+static int lease_add(const char *alias, Chunk *chunk, bool persistent, Lease **ret) {
+        Lease *lease;
+        size_t l;
+        int r;
+
+        assert(chunk);
+        assert(ret);
+
+        /* The alias is kept in the same allocation */
+        l = alias ? strlen(alias) + 1 : 0;
+
+        lease = malloc0(offsetof(Lease, alias_buf) + l);
+        if (!lease) {
+                free_chunk(chunk);
+                return -ENOMEM;
+        }
+
+        lease->chunk = *chunk;
+
+        r = lease_handle_new(lease);
+        if (r < 0)
+                goto fail;
+
+        r = uint64_hashmap_put(leasemap, &lease->chunk.start, lease);
+        if (r < 0)
+                goto fail;
+
+        if (alias) {
+                lease->alias = memcpy(lease->alias_buf, alias, l);
+
+                r = string_hashmap_put(aliasmap, lease->alias, lease);
+                if (r < 0)
+                        goto fail;
+        }
+
+        lease->persistent = persistent;
+
+        *ret = lease;
+        return 0;
+
+fail:
+        lease_release(lease);
+        return r;
+}
+
+static int lease_new(const char *alias, uint64_t start, uint64_t size, bool persistent, Lease **ret) {
+        Chunk chunk;
+        int r;
+
+        assert(ret);
+
+        if (alias && alias[0] == 0)
+                alias = NULL;
+
+        if (size == 0)
+                return -EINVAL;
+
+        if (alias) {
+                Lease *old;
+
+                old = string_hashmap_get(aliasmap, alias);
+                if (old && !old->quarantined)
+                        return -EEXIST;
+
+                /* Hand the same range back if it is what was asked
+                 * for, otherwise it is of no use to anybody anymore */
+                if (old) {
+                        if ((start == LEASE_ANYWHERE || start == old->chunk.start) &&
+                            old->chunk.len == pool->chunk_len(size))
+                                return lease_revive(old, persistent, ret);
+
+                        lease_evict(old);
+                }
+        }
+
+        for (;;) {
+                r = alloc_chunk(start, size, &chunk);
+                if (r != -ENOSPC && r != -EBUSY)
+                        break;
+                if (!quarantine_evict(start, size))
+                        break;
+        }
+        if (r < 0)
+                return r;
+
+        return lease_add(alias, &chunk, persistent, ret);
+}
+
+/* Gives up all leases of a client that disconnected, quarantining
+ * them like a release would. Those still waiting for the journal go
+ * once it is done with them. */
+static void owner_vanished(Owner *o) {
+        Lease *lease, *next;
+
+        if (o->gone)
+                return;
+        o->gone = true;
+
+        printf("owner gone: %s\n", o->name);
+
+        /* The owner goes away along with its last lease */
+        LIST_FOREACH_SAFE(owned, lease, next, o->leases)
+                if (!lease->committing)
+                        lease_retire(lease);
+}
+
+static int on_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        const char *name, *old_owner, *new_owner;
+        int r;
+
+        r = sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner);
+        if (r < 0) {
+                log_error("Failed to parse NameOwnerChanged: %s", strerror(-r));
+                return 0;
+        }
+
+        if (new_owner[0] == 0)
+                owner_vanished(userdata);
+
+        return 0;
+}
+
+static int on_name_owner_check(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Owner *o = userdata;
+
+        o->check = sd_bus_slot_unref(o->check);
+
+        /* Gone before the match was in place */
+        if (sd_bus_message_is_method_error(m, "org.freedesktop.DBus.Error.NameHasNoOwner"))
+                owner_vanished(o);
+
+        return 0;
+}
+
+static int owner_watch(sd_bus *bus, Owner *o) {
+        char *match;
+        int r;
+
+        match = newa(char, strlen(o->name) + 256);
+        sprintf(match,
+                "type='signal',sender='org.freedesktop.DBus',path='/org/freedesktop/DBus',"
+                "interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='%s'", o->name);
+
+        r = sd_bus_add_match_async(bus, &o->match, match, on_name_owner_changed, NULL, o);
+        if (r < 0)
+                return r;
+
+        /* The bus handles our calls in order, so this is answered
+         * with the match in place and nothing can slip through */
+        return sd_bus_call_method_async(bus, &o->check, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                        "org.freedesktop.DBus", "GetNameOwner", on_name_owner_check, o, "s", o->name);
+}
+
+/* Looks up the owner by bus name, or adds one that is not watched
+ * yet. Returns 1 in the latter case. */
+static int owner_get(const char *name, Owner **ret) {
+        Owner *o;
+        int r;
+
+        o = bus_name_hashmap_get(ownermap, name);
+        if (o) {
+                *ret = o;
+                return 0;
+        }
+
+        o = new0(Owner, 1);
+        if (!o)
+                return -ENOMEM;
+
+        o->name = strdup(name);
+        if (!o->name) {
+                free(o);
+                return -ENOMEM;
+        }
+
+        r = bus_name_hashmap_put(ownermap, o->name, o);
+        if (r < 0) {
+                free(o->name);
+                free(o);
+                return r;
+        }
+
+        *ret = o;
+        return 1;
+}
+
+/* Ties a volatile lease to the client that asked for it, so that it
+ * is released when the client disconnects without doing so */
+static int lease_set_owner(Lease *lease, sd_bus_message *m) {
+        const char *sender;
+        Owner *o;
+        int r;
+
+        if (lease->persistent)
+                return 0;
+
+        sender = sd_bus_message_get_sender(m);
+        if (!sender)
+                return 0;
+
+        r = owner_get(sender, &o);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                r = owner_watch(sd_bus_message_get_bus(m), o);
+                if (r < 0) {
+                        owner_free(o);
+                        return r;
+                }
+        }
+
+        LIST_PREPEND(owned, o->leases, lease);
+        lease->owner = o;
+
+        return 0;
+}
+
+/* Owners of leases taken over from our predecessor are only watched
+ * once we are on the bus. One that disconnected in between is found
+ * gone by the name check. */
+static int owners_watch(sd_bus *bus) {
+        Owner *o, **owners;
+        unsigned n = 0, k;
+        Iterator i;
+        int r;
+
+        owners = new(Owner*, MAX(bus_name_hashmap_size(ownermap), 1U));
+        if (!owners)
+                return -ENOMEM;
+
+        /* Giving up on one frees it */
+        BUS_NAME_HASHMAP_FOREACH(o, ownermap, i)
+                owners[n++] = o;
+
+        for (k = 0; k < n; k++) {
+                r = owner_watch(bus, owners[k]);
+                if (r < 0) {
+                        log_error("Failed to watch %s, releasing its leases: %s", owners[k]->name, strerror(-r));
+                        owner_vanished(owners[k]);
+                }
+        }
+
+        free(owners);
+        return 0;
+}
+
+static int on_lease_fd(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        Lease *lease = userdata;
+
+        printf("handle closed: " LEASE_FMT "\n", LEASE_FMT_ARGS(lease));
+
+        lease_retire(lease);
+        return 0;
+}
+
+/* Takes over fd, which is closed when the lease goes away */
+static int lease_watch_fd(sd_event *event, Lease *lease, int fd) {
+        int r;
+
+        assert(!lease->fd_source);
+
+        /* Nothing is ever read from it, the hangup is all we want */
+        r = sd_event_add_io(event, &lease->fd_source, fd, EPOLLHUP, on_lease_fd, lease);
+        if (r < 0)
+                return r;
+
+        r = sd_event_source_set_io_fd_own(lease->fd_source, true);
+        if (r < 0) {
+                lease->fd_source = sd_event_source_unref(lease->fd_source);
+                return r;
+        }
+
+        return 0;
+}
+
+static char *lease_path(Lease *lease, char path[LEASE_PATH_MAX]) {
+        char handle[LEASE_HANDLE_MAX];
+
+        snprintf(path, LEASE_PATH_MAX, LEASE_PATH_PREFIX "%s", lease_format_handle(lease, handle));
+        return path;
+}
+
+static Lease *lease_find(const char *path) {
+        const char *e;
+
+        e = startswith(path, LEASE_PATH_PREFIX);
+        if (e)
+                return lease_handle_find(e);
+
+        e = startswith(path, ALIAS_PATH_PREFIX);
+        if (e) {
+                Lease *lease;
+
+                lease = string_hashmap_get(aliasmap, e);
+                if (lease && !lease->quarantined)
+                        return lease;
+        }
+
+        return NULL;
+}
+
+typedef struct PendingReply {
+        sd_bus_message *call;
+        sd_bus_message *reply;
+        Lease **leases;
+        unsigned n_leases;
+} PendingReply;
+
+static void pending_reply_free(PendingReply *p) {
+        sd_bus_message_unref(p->call);
+        sd_bus_message_unref(p->reply);
+        free(p->leases);
+        free(p);
+}
+
+static void pending_reply_commit(int error, void *userdata) {
+        PendingReply *p = userdata;
+        unsigned i;
+        int r;
+
+        for (i = 0; i < p->n_leases; i++)
+                p->leases[i]->committing = false;
+
+        if (error < 0) {
+                for (i = 0; i < p->n_leases; i++)
+                        lease_rollback(p->leases[i]);
+
+                r = sd_bus_reply_method_errno(p->call, -error, NULL);
+        } else
+                r = sd_bus_send(sd_bus_message_get_bus(p->call), p->reply, NULL);
+        if (r < 0)
+                log_error("Failed to send reply: %s", strerror(-r));
+
+        /* Nobody is left to receive them */
+        if (error >= 0)
+                for (i = 0; i < p->n_leases; i++)
+                        if (p->leases[i]->owner && p->leases[i]->owner->gone)
+                                lease_retire(p->leases[i]);
+
+        pending_reply_free(p);
+}
+
+/* Sends the reply to a call that handed out the given leases. If any
+ * of them is persistent, the reply is held back until the journal has
+ * them on disk; should that fail, all of them are released again and
+ * the caller gets an error instead. */
+static int lease_reply(sd_bus_message *call, sd_bus_message *reply, Lease **leases, unsigned n_leases) {
+        PendingReply *p;
+        unsigned i, n_persistent = 0;
+        int r;
+
+        for (i = 0; i < n_leases; i++)
+                if (leases[i]->persistent)
+                        n_persistent++;
+
+        if (n_persistent == 0 || !journal)
+                return sd_bus_send(sd_bus_message_get_bus(call), reply, NULL);
+
+        p = new0(PendingReply, 1);
+        if (!p) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        p->leases = new(Lease*, n_leases);
+        if (!p->leases) {
+                free(p);
+                r = -ENOMEM;
+                goto fail;
+        }
+        memcpy(p->leases, leases, n_leases * sizeof(Lease*));
+        p->n_leases = n_leases;
+        p->call = sd_bus_message_ref(call);
+        p->reply = sd_bus_message_ref(reply);
+
+        /* All records go into the same batch, so the callback on the
+         * last one fires once all of them are durable */
+        for (i = 0; i < n_leases; i++) {
+                Lease *lease = leases[i];
+
+                if (!lease->persistent)
+                        continue;
+
+                n_persistent--;
+                r = journal_append(journal, JOURNAL_ALLOC, lease->chunk.start, lease->chunk.len, lease->alias, lease_handle_pack(lease),
+                                   n_persistent == 0 ? pending_reply_commit : NULL, p);
+                if (r < 0) {
+                        pending_reply_free(p);
+                        goto fail;
+                }
+        }
+
+        for (i = 0; i < n_leases; i++) {
+                leases[i]->committing = true;
+                leases[i]->committed_len = 0;
+        }
+
+        return 0;
+
+fail:
+        for (i = 0; i < n_leases; i++)
+                lease_rollback(leases[i]);
+
+        return sd_bus_reply_method_errno(call, -r, NULL);
+}
+
+int bus_lease_release(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        int r;
+        Lease *lease = userdata;
+
+        if (lease->committing) {
+                sd_bus_reply_method_errno(m, EBUSY, NULL);
+                return 1;
+        }
+
+        lease_retire(lease);
+
+        r = sd_bus_reply_method_return(m, "");
+        if (r < 0) {
+                log_error("Failed to send reply: %s", strerror(-r));
+                return r;
+        }
+
+
+        return 1;
+}
+int bus_lease_get_id(sd_bus *bus, const char *path, const char *interface, const char *property, sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+        char handle[LEASE_HANDLE_MAX];
+        Lease *lease = userdata;
+
+        sd_bus_message_append(reply, "s", lease_format_handle(lease, handle));
+        return 1;
+}
+int bus_lease_get_start(sd_bus *bus, const char *path, const char *interface, const char *property, sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+        Lease *lease = userdata;
+
+        sd_bus_message_append(reply, "t", lease->chunk.start);
+        return 1;
+}
+int bus_lease_get_end(sd_bus *bus, const char *path, const char *interface, const char *property, sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+        Lease *lease = userdata;
+
+        sd_bus_message_append(reply, "t", lease->chunk.start + lease->chunk.len - 1);
+        return 1;
+}
+int bus_lease_get_size(sd_bus *bus, const char *path, const char *interface, const char *property, sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+        Lease *lease = userdata;
+
+        sd_bus_message_append(reply, "t", lease->chunk.len);
+        return 1;
+}
+
+/* Turns a failed allocation into an error a client can act on. For
+ * one entry of a batch, entry is its index, otherwise -1. */
+static int reply_alloc_error(sd_bus_message *m, int error, int entry, const char *alias, uint64_t start, uint64_t size) {
+        char what[sizeof("Entry -2147483648: ")] = "";
+
+        if (entry >= 0)
+                snprintf(what, sizeof(what), "Entry %i: ", entry);
+
+        switch (error) {
+
+        case -EEXIST:
+                return sd_bus_reply_method_errorf(m, BUS_ERROR_ALIAS_EXISTS, "%sAlias %s is already leased", what, alias);
+
+        case -E2BIG:
+                return sd_bus_reply_method_errorf(m, BUS_ERROR_TOO_LARGE, "%sCannot lease more than %llu uids at once", what, CHUNK_MAX);
+
+        case -ENOSPC:
+                return sd_bus_reply_method_errorf(m, BUS_ERROR_NO_SPACE, "%sNo free range of %" PRIu64 " uids left", what, size);
+
+        case -EBUSY:
+                return sd_bus_reply_method_errorf(m, BUS_ERROR_RANGE_BUSY, "%sRange %" PRIu64 "+%" PRIu64 " overlaps an existing lease", what, start, size);
+
+        case -EINVAL:
+                if (start != LEASE_ANYWHERE)
+                        return sd_bus_reply_method_errorf(m, BUS_ERROR_INVALID_RANGE, "%sRange %" PRIu64 "+%" PRIu64 " cannot be leased from the %s pool", what, start, size, pool->name);
+                /* fall through */
+
+        default:
+                if (entry >= 0)
+                        return sd_bus_reply_method_errnof(m, -error, "%sCannot lease %" PRIu64 " uids for %s: %s", what, size, alias, strerror(-error));
+                return sd_bus_reply_method_errno(m, -error, NULL);
+        }
+}
+
+static int lease_alloc_reply(sd_bus_message *m, const char *alias, uint64_t start, uint64_t size, bool persistent, uint64_t ttl) {
+        char path[LEASE_PATH_MAX];
+        sd_bus_message *reply = NULL;
+        Lease *lease;
+        int r;
+
+        r = lease_new(alias, start, size, persistent, &lease);
+        if (r < 0) {
+                reply_alloc_error(m, r, -1, alias, start, size);
+                return 1;
+        }
+
+        if (ttl > 0) {
+                lease_schedule(lease, ttl, ttl);
+                wheel_arm();
+        }
+
+        r = lease_set_owner(lease, m);
+        if (r >= 0)
+                r = sd_bus_message_new_method_return(m, &reply);
+        if (r >= 0)
+                r = sd_bus_message_append(reply, "ott", lease_path(lease, path), lease->chunk.start, lease->chunk.len);
+        if (r < 0) {
+                lease_rollback(lease);
+                sd_bus_message_unref(reply);
+                sd_bus_reply_method_errno(m, -r, NULL);
+                return 1;
+        }
+
+        r = lease_reply(m, reply, &lease, 1);
+        sd_bus_message_unref(reply);
+        if (r < 0) {
+                log_error("Failed to send reply: %s", strerror(-r));
+                return r;
+        }
+
+        return 1;
+}
+
+int bus_lease_alloc(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        int r;
+        uint64_t size;
+        uint32_t persistent;
+        const char *alias = NULL;
+
+        r = sd_bus_message_read(m, "stb", &alias, &size, &persistent);
+        if (r < 0) {
+                log_error("Failed to read request: %s", strerror(-r));
+                return r;
+        }
+
+        return lease_alloc_reply(m, alias, LEASE_ANYWHERE, size, persistent, 0);
+}
+
+int bus_lease_alloc_fd(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        char path[LEASE_PATH_MAX];
+        sd_bus_message *reply = NULL;
+        const char *alias = NULL;
+        Lease *lease;
+        uint64_t size;
+        int r, fds[2];
+
+        r = sd_bus_message_read(m, "st", &alias, &size);
+        if (r < 0) {
+                log_error("Failed to read request: %s", strerror(-r));
+                return r;
+        }
+
+        /* Not tied to the caller's bus name: the handle may well be
+         * passed on to somebody who outlives it */
+        r = lease_new(alias, LEASE_ANYWHERE, size, false, &lease);
+        if (r < 0) {
+                reply_alloc_error(m, r, -1, alias, LEASE_ANYWHERE, size);
+                return 1;
+        }
+
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, fds) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = lease_watch_fd(sd_bus_get_event(bus), lease, fds[0]);
+        if (r < 0) {
+                close(fds[0]);
+                close(fds[1]);
+                goto fail;
+        }
+
+        r = sd_bus_message_new_method_return(m, &reply);
+        if (r >= 0)
+                r = sd_bus_message_append(reply, "otth", lease_path(lease, path), lease->chunk.start, lease->chunk.len, fds[1]);
+        close(fds[1]);
+        if (r < 0)
+                goto fail;
+
+        r = lease_reply(m, reply, &lease, 1);
+        sd_bus_message_unref(reply);
+        if (r < 0) {
+                log_error("Failed to send reply: %s", strerror(-r));
+                return r;
+        }
+
+        return 1;
+
+fail:
+        lease_rollback(lease);
+        sd_bus_message_unref(reply);
+        sd_bus_reply_method_errno(m, -r, NULL);
+        return 1;
+}
+
+int bus_lease_alloc_ttl(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        int r;
+        uint64_t size, ttl;
+        const char *alias = NULL;
+
+        r = sd_bus_message_read(m, "stt", &alias, &size, &ttl);
+        if (r < 0) {
+                log_error("Failed to read request: %s", strerror(-r));
+                return r;
+        }
+
+        /* Such leases are never persistent: the journal has no idea
+         * of time, and a lease nobody renews is not worth keeping */
+        if (ttl == 0) {
+                sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS, "TTL must not be zero");
+                return 1;
+        }
+
+        return lease_alloc_reply(m, alias, LEASE_ANYWHERE, size, false, ttl);
+}
+
+int bus_lease_alloc_at(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        int r;
+        uint64_t start, size;
+        uint32_t persistent;
+        const char *alias = NULL;
+
+        r = sd_bus_message_read(m, "sttb", &alias, &start, &size, &persistent);
+        if (r < 0) {
+                log_error("Failed to read request: %s", strerror(-r));
+                return r;
+        }
+
+        /* Would otherwise mean anywhere */
+        if (start == LEASE_ANYWHERE) {
+                sd_bus_reply_method_errorf(m, BUS_ERROR_INVALID_RANGE, "Start %" PRIu64 " is out of range", start);
+                return 1;
+        }
+
+        return lease_alloc_reply(m, alias, start, size, persistent, 0);
+}
+
+/* Whether evicting a single quarantined chunk would free a range the
+ * size of the request. Smaller chunks that would only merge into one
+ * large enough after evicting several are not considered. */
+static bool quarantine_can_make_room(uint64_t size) {
+        uint64_t want = pool->chunk_len(size);
+        unsigned c = chunk_class(want);
+        Lease *lease;
+
+        if (c < 63 && (quarantine_mask >> (c + 1)) != 0)
+                return true;
+        if (!(quarantine_mask & (UINT64_C(1) << c)))
+                return false;
+        if ((want & (want - 1)) == 0)
+                return true;
+
+        /* Only extents that are not a power of two get here */
+        LIST_FOREACH(quarantine, lease, quarantine)
+                if (lease->chunk.len >= want)
+                        return true;
+
+        return false;
+}
+
+int bus_can_allocate(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        uint64_t size;
+        int r;
+
+        r = sd_bus_message_read(m, "t", &size);
+        if (r < 0) {
+                log_error("Failed to read request: %s", strerror(-r));
+                return r;
+        }
+
+        if (size == 0) {
+                sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS, "Size must not be zero");
+                return 1;
+        }
+
+        r = pool->can_alloc(size);
+        if (r < 0 && r != -ENOSPC) {
+                reply_alloc_error(m, r, -1, NULL, LEASE_ANYWHERE, size);
+                return 1;
+        }
+        if (r == -ENOSPC && quarantine_can_make_room(size))
+                r = 0;
+
+        r = sd_bus_reply_method_return(m, "b", r >= 0);
+        if (r < 0) {
+                log_error("Failed to send reply: %s", strerror(-r));
+                return r;
+        }
+
+        return 1;
+}
+
+typedef struct PendingResize {
+        sd_bus_message *call;
+        Lease *lease;
+        uint64_t old_len;
+} PendingResize;
+
+static int lease_resize_reply(sd_bus_message *m, Lease *lease) {
+        char path[LEASE_PATH_MAX];
+        int r;
+
+        r = sd_bus_reply_method_return(m, "t", lease->chunk.len);
+        if (r < 0)
+                return r;
+
+        return sd_bus_emit_properties_changed(sd_bus_message_get_bus(m), lease_path(lease, path),
+                                              "be.enospc.uidallocd.Lease", "Size", "End", NULL);
+}
+
+static void pending_resize_commit(int error, void *userdata) {
+        PendingResize *p = userdata;
+        int r;
+
+        p->lease->committing = false;
+
+        if (error < 0) {
+                /* Shrinking back cannot collide with anything. The
+                 * failed record is retried, so log the way back too. */
+                r = pool->resize(&p->lease->chunk, p->old_len);
+                if (r >= 0)
+                        r = journal_append(journal, JOURNAL_RESIZE, p->lease->chunk.start, p->lease->chunk.len, NULL, JOURNAL_NO_HANDLE, NULL, NULL);
+                if (r < 0)
+                        log_error("Failed to undo resize of " LEASE_FMT ": %s", LEASE_FMT_ARGS(p->lease), strerror(-r));
+
+                r = sd_bus_reply_method_errno(p->call, -error, NULL);
+        } else
+                r = lease_resize_reply(p->call, p->lease);
+        if (r < 0)
+                log_error("Failed to send reply: %s", strerror(-r));
+
+        sd_bus_message_unref(p->call);
+        free(p);
+}
+
+int bus_lease_resize(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Lease *lease = userdata;
+        PendingResize *p;
+        uint64_t size, old_len;
+        int r;
+
+        r = sd_bus_message_read(m, "t", &size);
+        if (r < 0) {
+                log_error("Failed to read request: %s", strerror(-r));
+                return r;
+        }
+
+        if (lease->committing) {
+                sd_bus_reply_method_errno(m, EBUSY, NULL);
+                return 1;
+        }
+        if (size == 0) {
+                sd_bus_reply_method_errno(m, EINVAL, NULL);
+                return 1;
+        }
+
+        old_len = lease->chunk.len;
+        r = pool->resize(&lease->chunk, size);
+        if (r == -EBUSY) {
+                sd_bus_reply_method_errorf(m, BUS_ERROR_RANGE_BUSY, "Cannot grow " LEASE_FMT " in place, the uids behind it are taken", LEASE_FMT_ARGS(lease));
+                return 1;
+        }
+        if (r < 0) {
+                reply_alloc_error(m, r, -1, lease->alias, lease->chunk.start, size);
+                return 1;
+        }
+
+        if (lease->chunk.len == old_len || !lease->persistent || !journal)
+                goto reply;
+
+        /* A shrink that gets lost merely hands the uids back later,
+         * but a grow must be on disk before anybody uses it */
+        if (lease->chunk.len < old_len) {
+                r = journal_append(journal, JOURNAL_RESIZE, lease->chunk.start, lease->chunk.len, NULL, JOURNAL_NO_HANDLE, NULL, NULL);
+                if (r < 0)
+                        log_error("Failed to log resize of " LEASE_FMT ": %s", LEASE_FMT_ARGS(lease), strerror(-r));
+                goto reply;
+        }
+
+        p = new0(PendingResize, 1);
+        if (!p) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        r = journal_append(journal, JOURNAL_RESIZE, lease->chunk.start, lease->chunk.len, NULL, JOURNAL_NO_HANDLE, pending_resize_commit, p);
+        if (r < 0) {
+                free(p);
+                goto fail;
+        }
+
+        p->call = sd_bus_message_ref(m);
+        p->lease = lease;
+        p->old_len = old_len;
+        lease->committing = true;
+        lease->committed_len = old_len;
+
+        return 1;
+
+reply:
+        r = lease_resize_reply(m, lease);
+        if (r < 0) {
+                log_error("Failed to send reply: %s", strerror(-r));
+                return r;
+        }
+
+        return 1;
+
+fail:
+        (void) pool->resize(&lease->chunk, old_len);
+        sd_bus_reply_method_errno(m, -r, NULL);
+        return 1;
+}
+
+int bus_lease_alloc_batch(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        sd_bus_message *reply = NULL;
+        Lease **leases = NULL;
+        unsigned n = 0, allocated = 0, i;
+        const char *alias = NULL;
+        uint64_t size = 0;
+        bool refused = false;
+        int r;
+
+        /* All leases of a batch are handed out together or not at
+         * all, and answered with a single reply */
+
+        r = sd_bus_message_new_method_return(m, &reply);
+        if (r < 0)
+                goto fail;
+
+        r = sd_bus_message_open_container(reply, 'a', "(ott)");
+        if (r < 0)
+                goto fail;
+
+        r = sd_bus_message_enter_container(m, 'a', "(stb)");
+        if (r < 0)
+                goto fail;
+
+        for (;;) {
+                char path[LEASE_PATH_MAX];
+                uint32_t persistent;
+
+                r = sd_bus_message_read(m, "(stb)", &alias, &size, &persistent);
+                if (r < 0)
+                        goto fail;
+                if (r == 0)
+                        break;
+
+                if (n >= allocated) {
+                        Lease **t;
+
+                        allocated = MAX(allocated * 2, 16U);
+                        t = realloc(leases, allocated * sizeof(Lease*));
+                        if (!t) {
+                                r = -ENOMEM;
+                                goto fail;
+                        }
+                        leases = t;
+                }
+
+                r = lease_new(alias, LEASE_ANYWHERE, size, persistent, &leases[n]);
+                if (r < 0) {
+                        refused = true;
+                        goto fail;
+                }
+                n++;
+
+                r = lease_set_owner(leases[n-1], m);
+                if (r < 0)
+                        goto fail;
+
+                r = sd_bus_message_append(reply, "(ott)", lease_path(leases[n-1], path), leases[n-1]->chunk.start, leases[n-1]->chunk.len);
+                if (r < 0)
+                        goto fail;
+        }
+
+        r = sd_bus_message_exit_container(m);
+        if (r < 0)
+                goto fail;
+
+        r = sd_bus_message_close_container(reply);
+        if (r < 0)
+                goto fail;
+
+        r = lease_reply(m, reply, leases, n);
+        sd_bus_message_unref(reply);
+        free(leases);
+        if (r < 0) {
+                log_error("Failed to send reply: %s", strerror(-r));
+                return r;
+        }
+
+        return 1;
+
+fail:
+        for (i = 0; i < n; i++)
+                lease_rollback(leases[i]);
+        free(leases);
+        sd_bus_message_unref(reply);
+
+        if (refused)
+                reply_alloc_error(m, r, n, alias, LEASE_ANYWHERE, size);
+        else
+                sd_bus_reply_method_errno(m, -r, NULL);
+        return 1;
+}
+
+int bus_lease_release_many(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        char **paths = NULL, **p;
+        int r;
+
+        r = sd_bus_message_read_strv(m, &paths);
+        if (r < 0) {
+                log_error("Failed to read request: %s", strerror(-r));
+                return r;
+        }
+
+        /* Check everything first, so that either all or none of the
+         * leases go away */
+        for (p = paths; p && *p; p++) {
+                Lease *lease;
+
+                lease = lease_find(*p);
+                if (!lease) {
+                        r = sd_bus_reply_method_errorf(m, SD_BUS_ERROR_UNKNOWN_OBJECT, "No lease at %s", *p);
+                        goto finish;
+                }
+                if (lease->committing) {
+                        r = sd_bus_reply_method_errno(m, EBUSY, NULL);
+                        goto finish;
+                }
+        }
+
+        for (p = paths; p && *p; p++) {
+                Lease *lease;
+
+                /* The same lease may be listed twice */
+                lease = lease_find(*p);
+                if (lease)
+                        lease_retire(lease);
+        }
+
+        r = sd_bus_reply_method_return(m, "");
+        if (r < 0)
+                log_error("Failed to send reply: %s", strerror(-r));
+
+finish:
+        for (p = paths; p && *p; p++)
+                free(*p);
+        free(paths);
+
+        return r < 0 ? r : 1;
+}
+
+int bus_lease_renew_many(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        char **paths = NULL, **p;
+        int r;
+
+        r = sd_bus_message_read_strv(m, &paths);
+        if (r < 0) {
+                log_error("Failed to read request: %s", strerror(-r));
+                return r;
+        }
+
+        for (p = paths; p && *p; p++)
+                if (!lease_find(*p)) {
+                        r = sd_bus_reply_method_errorf(m, SD_BUS_ERROR_UNKNOWN_OBJECT, "No lease at %s", *p);
+                        goto finish;
+                }
+
+        /* Leases without a ttl have nothing to renew, and those that
+         * expired but are not reclaimed yet are saved by this */
+        for (p = paths; p && *p; p++) {
+                Lease *lease;
+
+                lease = lease_find(*p);
+                if (lease->ttl > 0)
+                        lease_schedule(lease, lease->ttl, lease->ttl);
+        }
+        wheel_arm();
+
+        r = sd_bus_reply_method_return(m, "");
+        if (r < 0)
+                log_error("Failed to send reply: %s", strerror(-r));
+
+finish:
+        for (p = paths; p && *p; p++)
+                free(*p);
+        free(paths);
+
+        return r < 0 ? r : 1;
+}
+
+static const sd_bus_vtable lease_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_METHOD("Release", "", "", bus_lease_release, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("Resize", "t", "t", bus_lease_resize, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_PROPERTY("Start", "t", bus_lease_get_start, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("End", "t", bus_lease_get_end, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+        SD_BUS_PROPERTY("Size", "t", bus_lease_get_size, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+        SD_BUS_PROPERTY("ID", "s", bus_lease_get_id, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("Alias", "s", NULL, offsetof(Lease, alias), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("TTL", "t", NULL, offsetof(Lease, ttl), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_VTABLE_END,
+};
+
+static const sd_bus_vtable main_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_METHOD("AllocUids", "stb", "ott", bus_lease_alloc, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("AllocUidsAt", "sttb", "ott", bus_lease_alloc_at, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("AllocUidsWithTTL", "stt", "ott", bus_lease_alloc_ttl, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("AllocUidsFd", "st", "otth", bus_lease_alloc_fd, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("AllocUidsBatch", "a(stb)", "a(ott)", bus_lease_alloc_batch, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("CanAllocate", "t", "b", bus_can_allocate, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("ReleaseMany", "ao", "", bus_lease_release_many, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("RenewLeases", "ao", "", bus_lease_renew_many, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_VTABLE_END,
+};
+
+int lease_object_find(sd_bus *bus, const char *path, const char *interface, void *userdata, void **found, sd_bus_error *error) {
+        Lease *lease;
+
+        lease = lease_find(path);
+        if (!lease)
+                return 0;
+
+        *found = lease;
+        return 1;
+}
+
+/* Puts a restored lease back at the object path it had, if known */
+static void lease_reclaim_handle(Lease *lease, uint32_t slot, uint32_t generation) {
+        int r;
+
+        r = lease_handle_claim(lease, slot, generation);
+        if (r < 0)
+                log_error("Failed to restore handle of " LEASE_FMT ", its object path changes: %s", LEASE_FMT_ARGS(lease), strerror(-r));
+}
+
+static int lease_replay(JournalType type, uint64_t start, uint64_t len, const char *alias, uint64_t handle, void *userdata) {
+        unsigned *n_replayed = userdata;
+        Lease *lease;
+        int r;
+
+        (*n_replayed)++;
+
+        switch (type) {
+
+        case JOURNAL_ALLOC:
+                r = lease_new(alias, start, len, true, &lease);
+                if (r < 0) {
+                        log_error("Failed to restore lease %" PRIu64 "+%" PRIu64 ": %s", start, len, strerror(-r));
+                        return r;
+                }
+                if (handle != JOURNAL_NO_HANDLE)
+                        lease_reclaim_handle(lease, handle >> 32, (uint32_t) handle);
+                return 0;
+
+        case JOURNAL_RELEASE:
+                lease = uint64_hashmap_get(leasemap, &start);
+                if (lease)
+                        lease_release(lease);
+                return 0;
+
+        case JOURNAL_RESIZE:
+                lease = uint64_hashmap_get(leasemap, &start);
+                if (!lease)
+                        return 0;
+
+                r = pool->resize(&lease->chunk, len);
+                if (r < 0) {
+                        log_error("Failed to resize lease " LEASE_FMT " to %" PRIu64 ": %s", LEASE_FMT_ARGS(lease), len, strerror(-r));
+                        return r;
+                }
+                return 0;
+
+        default:
+                log_error("Unknown journal record type %u", type);
+                return -EBADMSG;
+        }
+}
+
+static int lease_restore(const Chunk *chunk, const SnapshotLease *l, void *userdata) {
+        bool *keep_volatile = userdata;
+        bool quarantined = l->flags & SNAPSHOT_LEASE_QUARANTINED;
+        const char *alias = l->alias;
+        unsigned flags = l->flags;
+        Chunk c = *chunk;
+        Lease *lease;
+        int r;
+
+        /* Leases that were not meant to outlive the daemon are only
+         * written out so a snapshot is complete, drop them unless we
+         * are taking over from our predecessor */
+        if (!(flags & SNAPSHOT_LEASE_PERSISTENT) && !*keep_volatile) {
+                pool->free(&c);
+                return 0;
+        }
+
+        if (quarantined && (!alias || arg_quarantine_usec == 0)) {
+                pool->free(&c);
+                return 0;
+        }
+
+        r = lease_add(alias, &c, flags & SNAPSHOT_LEASE_PERSISTENT, &lease);
+        if (r < 0) {
+                log_error("Failed to restore lease %" PRIu64 "+%" PRIu64 ": %s", chunk->start, chunk->len, strerror(-r));
+                return r;
+        }
+
+        if (flags & SNAPSHOT_LEASE_HANDLE)
+                lease_reclaim_handle(lease, l->slot, l->generation);
+        lease->awaiting_fd = flags & SNAPSHOT_LEASE_FD;
+
+        if ((flags & SNAPSHOT_LEASE_OWNED) && !quarantined) {
+                Owner *o;
+
+                r = owner_get(l->owner, &o);
+                if (r < 0) {
+                        log_error("Failed to restore owner of " LEASE_FMT ": %s", LEASE_FMT_ARGS(lease), strerror(-r));
+                        return r;
+                }
+
+                LIST_PREPEND(owned, o->leases, lease);
+                lease->owner = o;
+        }
+
+        /* The grace period starts over */
+        if (quarantined)
+                lease_quarantine(lease, now_usec() + arg_quarantine_usec);
+        else if (flags & SNAPSHOT_LEASE_EXPIRES)
+                lease_schedule(lease, l->ttl, l->remaining);
+
+        return 0;
+}
+
+static char *state_path(const char *name) {
+        char *path;
+
+        assert(state_dir);
+
+        path = malloc(strlen(state_dir) + 1 + strlen(name) + 1);
+        if (path)
+                sprintf(path, "%s/%s", state_dir, name);
+
+        return path;
+}
+
+/* Like state_path(), but below the directory in the given variable */
+static char *env_path(const char *variable, const char *name) {
+        const char *e;
+        char *path;
+
+        e = getenv(variable);
+        if (!e || e[0] != '/')
+                return NULL;
+
+        path = malloc(strlen(e) + 1 + strlen(name) + 1);
+        if (path)
+                sprintf(path, "%s/%s", e, name);
+
+        return path;
+}
+
+/* The directory the service manager set up for us, if any, else the
+ * XDG state directory of whoever we run as, since we live on their
+ * bus. NULL if there is neither. */
+static char *default_state_dir(void) {
+        const char *e;
+        char *path;
+
+        /* Might be a list, the first one is ours */
+        e = getenv("STATE_DIRECTORY");
+        if (e && e[0] == '/')
+                return strndup(e, strcspn(e, ":"));
+
+        path = env_path("XDG_STATE_HOME", "uidallocd");
+        if (!path)
+                path = env_path("HOME", ".local/state/uidallocd");
+
+        return path;
+}
+
+static int mkdir_parents(const char *path, mode_t mode) {
+        char *p, *slash;
+
+        p = strcpy(newa(char, strlen(path) + 1), path);
+        for (slash = strchr(p + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+                *slash = 0;
+                if (mkdir(p, mode) < 0 && errno != EEXIST)
+                        return -errno;
+                *slash = '/';
+        }
+
+        if (mkdir(p, mode) < 0 && errno != EEXIST)
+                return -errno;
+
+        return 0;
+}
+
+/* With durable, only what the journal has on disk goes in, along with
+ * the seqnum of its last record. That is only for the snapshot writer,
+ * which may change its copy of the pool to match. */
+static int serialize_state(bool durable, void **ret, size_t *ret_size) {
+        SnapshotLease *leases;
+        Lease *lease;
+        Iterator i;
+        unsigned n = 0;
+        uint64_t now, seqnum = 0;
+        int r;
+
+        leases = new0(SnapshotLease, MAX(uint64_hashmap_size(leasemap) + n_quarantined, 1U));
+        if (!leases)
+                return -ENOMEM;
+
+        now = now_usec();
+
+        UINT64_HASHMAP_FOREACH(lease, leasemap, i) {
+                leases[n].len = lease->chunk.len;
+
+                /* Whoever asked for these has no answer yet, and may
+                 * still get an error */
+                if (durable && lease->committing) {
+                        Chunk c = lease->chunk;
+
+                        if (lease->committed_len == 0) {
+                                pool->free(&c);
+                                continue;
+                        }
+
+                        r = pool->resize(&c, lease->committed_len);
+                        if (r < 0) {
+                                free(leases);
+                                return r;
+                        }
+                        leases[n].len = c.len;
+                }
 
-#define POOL_START (1ULL<<31)
-#define POOL_END UINT32_MAX
-#define CHUNK_MAX_EXP 28
-//#define POOL_START 0
-//#define POOL_END 2047
-//#define CHUNK_MAX_EXP 8
-
-#define CHUNK_MAX (1ULL << (CHUNK_MAX_EXP - 1))
-#define INIT_CHUNK_COUNT ((POOL_END - POOL_START + 1) / CHUNK_MAX)
-
-typedef struct Chunk Chunk;
-
-struct Chunk {
-        uint64_t start;
-        uint32_t size;
-        bool allocated;
-        Chunk *parent;
-        Chunk *children;
-        LIST_FIELDS(Chunk, freelist);
-};
+                leases[n].start = lease->chunk.start;
+                leases[n].alias = lease->alias;
+                leases[n].flags = SNAPSHOT_LEASE_HANDLE;
+                if (lease->persistent)
+                        leases[n].flags |= SNAPSHOT_LEASE_PERSISTENT;
+                if (lease->fd_source)
+                        leases[n].flags |= SNAPSHOT_LEASE_FD;
+                if (lease->owner) {
+                        leases[n].flags |= SNAPSHOT_LEASE_OWNED;
+                        leases[n].owner = lease->owner->name;
+                }
+                leases[n].slot = lease->slot;
+                leases[n].generation = lease->generation;
+                if (lease->ttl > 0) {
+                        leases[n].flags |= SNAPSHOT_LEASE_EXPIRES;
+                        leases[n].ttl = lease->ttl;
+                        leases[n].remaining = LESS_BY(lease->expire_tick * WHEEL_TICK_USEC, now);
+                }
+                n++;
+        }
+
+        /* Their uids are taken in the pool state all the same */
+        LIST_FOREACH(quarantine, lease, quarantine) {
+                leases[n].start = lease->chunk.start;
+                leases[n].len = lease->chunk.len;
+                leases[n].alias = lease->alias;
+                leases[n].flags = SNAPSHOT_LEASE_QUARANTINED;
+                n++;
+        }
 
-typedef struct Slice {
-        LIST_HEAD(Chunk) list;
-} Slice;
+        if (journal)
+                seqnum = durable ? journal_written_seqnum(journal) : journal_seqnum(journal);
 
-Slice pool[CHUNK_MAX_EXP];
-Chunk *root;
+        r = snapshot_serialize(pool, seqnum, leases, n, ret, ret_size);
+        free(leases);
 
-uint32_t bitsize(uint64_t in) {
-        assert(in > 0);
-        if (in == 1)
-                return 1;
-        return (uint32_t) (sizeof(long) * __CHAR_BIT__ - __builtin_clzl(in-1))+1;
+        return r;
+}
+
+static int save_snapshot(void) {
+        char *path;
+        void *buf;
+        size_t size;
+        int r;
+
+        r = serialize_state(true, &buf, &size);
+        if (r < 0)
+                return r;
+
+        path = state_path("snapshot");
+        if (!path) {
+                free(buf);
+                return -ENOMEM;
+        }
+
+        r = snapshot_write(path, buf, size);
+        free(path);
+        free(buf);
+
+        return r;
 }
 
-int chunk_split(Chunk *c) {
-        printf("  splitting chunk: start: %llu size: %u (%llu)\n", c->start, c->size, 1UL << (c->size-1));
+/* Parks the complete state, volatile leases included, with the service
+ * manager, so that the next instance can pick up where we left off */
+static int stash_state(void) {
+        Lease *lease;
+        Iterator i;
+        void *buf;
+        size_t size;
+        int fd, r;
+
+        if (!getenv("NOTIFY_SOCKET"))
+                return 0;
+
+        r = serialize_state(false, &buf, &size);
+        if (r < 0)
+                return r;
+
+        r = snapshot_write_memfd(buf, size, &fd);
+        free(buf);
+        if (r < 0)
+                return r;
+
+        r = sd_pid_notify_with_fds(0, false, "FDSTORE=1\nFDNAME=" STASH_FDNAME, &fd, 1);
+        close(fd);
+        if (r < 0)
+                return r;
+        if (r == 0)
+                return -EOPNOTSUPP;
+
+        /* Our ends of the lease handles go along, named after the
+         * start of their lease, or the clients would see them hang up */
+        UINT64_HASHMAP_FOREACH(lease, leasemap, i) {
+                char store[sizeof("FDSTORE=1\nFDNAME=") + LEASE_FDNAME_MAX];
+
+                if (!lease->fd_source)
+                        continue;
 
-        c->children = new0(Chunk, 2);
-        c->children[0].start = c->start;
-        c->children[0].size = c->size -1;
-        c->children[0].parent = c;
+                snprintf(store, sizeof(store), "FDSTORE=1\nFDNAME=" LEASE_FDNAME_PREFIX "%016" PRIx64, lease->chunk.start);
+                fd = sd_event_source_get_io_fd(lease->fd_source);
 
-        c->children[1].start = c->start + (1ull<<(c->size - 2));
-        c->children[1].size = c->size -1;
-        c->children[1].parent = c;
+                r = sd_pid_notify_with_fds(0, false, store, &fd, 1);
+                if (r < 0)
+                        log_error("Failed to stash handle of " LEASE_FMT ": %s", LEASE_FMT_ARGS(lease), strerror(-r));
+        }
 
         return 0;
 }
 
-Chunk *chunk_get(uint32_t size) {
-        Slice *slice;
-        Chunk *chunk;
+/* Sizes both tables for the snapshot up front, so that restoring it
+ * never has to grow them */
+static int reserve_leases(Snapshot *s) {
+        int r;
 
-        if (size > CHUNK_MAX_EXP)
-                return NULL;
+        r = uint64_hashmap_reserve(leasemap, snapshot_n_leases(s));
+        if (r < 0)
+                return r;
 
-        slice = &(pool[size-1]);
-        chunk = LIST_STEAL_FIRST(freelist, slice->list);
-        if (!chunk) {
-                Chunk *parent, *children;
-                parent = chunk_get(size + 1);
-                if (!parent)
-                        return NULL;
+        return string_hashmap_reserve(aliasmap, snapshot_n_aliases(s));
+}
 
-                assert(parent->size == size + 1);
+static void drop_leases(void) {
+        Lease *lease;
 
-                chunk_split(parent);
-                LIST_PREPEND(freelist, slice->list, &(parent->children[1]));
-                chunk = &(parent->children[0]);
+        while ((lease = uint64_hashmap_first(leasemap))) {
+                pool->free(&lease->chunk);
+                lease_free(lease);
         }
-        chunk->allocated = true;
 
-        return chunk;
+        while (quarantine)
+                lease_evict(quarantine);
 }
 
-Chunk *alloc_chunk(uint64_t size) {
-        uint32_t bs;
-        Chunk *c;
+/* Hands our ends of the socket pairs back to the leases they belong
+ * to, and closes those no lease made it back for */
+static void adopt_lease_fds(sd_event *event, char **names, int n) {
+        Lease *l, **orphans;
+        unsigned n_orphans = 0, k;
+        Iterator it;
+        int i, r;
+
+        for (i = 0; i < n; i++) {
+                char remove[sizeof("FDSTOREREMOVE=1\nFDNAME=") + LEASE_FDNAME_MAX];
+                int fd = SD_LISTEN_FDS_START + i;
+                uint64_t start;
+                Lease *lease = NULL;
+                const char *e;
+                char *end;
+
+                e = startswith(names[i], LEASE_FDNAME_PREFIX);
+                if (!e)
+                        continue;
+
+                errno = 0;
+                start = strtoull(e, &end, 16);
+                if (errno == 0 && end != e && *end == 0)
+                        lease = uint64_hashmap_get(leasemap, &start);
+
+                r = lease && !lease->fd_source ? lease_watch_fd(event, lease, fd) : -ENOENT;
+                if (r < 0)
+                        close(fd);
+                else
+                        lease->awaiting_fd = false;
+
+                snprintf(remove, sizeof(remove), "FDSTOREREMOVE=1\nFDNAME=%s", names[i]);
+                (void) sd_notify(false, remove);
+        }
+
+        /* Whoever held the other end of the ones that did not come
+         * back can no longer close it to let go */
+        orphans = new(Lease*, MAX(uint64_hashmap_size(leasemap), 1U));
+        if (!orphans) {
+                log_error("Failed to retire leases without handle: %s", strerror(ENOMEM));
+                return;
+        }
+
+        UINT64_HASHMAP_FOREACH(l, leasemap, it)
+                if (l->awaiting_fd)
+                        orphans[n_orphans++] = l;
 
-        bs = bitsize(size);
+        for (k = 0; k < n_orphans; k++) {
+                printf("handle lost: " LEASE_FMT "\n", LEASE_FMT_ARGS(orphans[k]));
 
-        c = chunk_get(bs);
-        printf(" allocated chunk : start: %llu size: %u (%llu) requested: %u (%llu)\n", c->start, c->size, 1ULL << (c->size-1), bs, size);
-        return c;
+                orphans[k]->awaiting_fd = false;
+                lease_retire(orphans[k]);
+        }
+
+        free(orphans);
 }
 
-Chunk *free_chunk(Chunk *c) {
+static int load_stash(sd_event *event, uint64_t *ret_seqnum) {
+        bool keep_volatile = true;
+        char **names = NULL;
+        Snapshot *s = NULL;
+        int n, i, r = 0;
 
-        printf(" freeing chunk : start: %llu size: %u (%llu)\n", c->start, c->size, 1ULL << (c->size-1));
+        n = sd_listen_fds_with_names(true, &names);
+        if (n <= 0)
+                return n;
 
-        c->allocated = false;
+        for (i = 0; i < n; i++) {
+                int fd = SD_LISTEN_FDS_START + i;
 
-        if (c->parent && c->parent->children[0].allocated == false && c->parent->children[1].allocated == false) {
-                Chunk *p = c->parent;
+                /* Lease handles are picked up once the leases are back */
+                if (startswith(names[i], LEASE_FDNAME_PREFIX))
+                        continue;
 
-                printf("  mergeing chunk : start: %llu size: %u (%llu)\n", p->start, p->size, 1ULL << (p->size-1));
-                LIST_REMOVE(freelist, pool[c->size-1].list, &(p->children[0]));
-                LIST_REMOVE(freelist, pool[c->size-1].list, &(p->children[1]));
-                free(c->parent->children);
-                c->parent->children = NULL;
-                free_chunk(p);
-        } else {
-                LIST_PREPEND(freelist, pool[c->size-1].list, c);
+                if (r == 0 && streq(names[i], STASH_FDNAME)) {
+                        r = snapshot_open_fd(fd, &s);
+                        if (r >= 0)
+                                r = 1;
+                }
+
+                close(fd);
         }
 
-        return NULL;
+        /* Should we crash from here on, the stash is outdated */
+        (void) sd_notify(false, "FDSTOREREMOVE=1\nFDNAME=" STASH_FDNAME);
+
+        if (r <= 0) {
+                if (r < 0)
+                        log_error("Failed to open stashed state: %s", strerror(-r));
+                r = 0;
+                goto finish;
+        }
+
+        r = reserve_leases(s);
+        if (r >= 0)
+                r = snapshot_restore(s, pool, lease_restore, &keep_volatile);
+        if (r < 0) {
+                log_error("Failed to restore stashed state, falling back to disk: %s", strerror(-r));
+                drop_leases();
+                snapshot_close(s);
+                r = 0;
+                goto finish;
+        }
+
+        *ret_seqnum = snapshot_seqnum(s);
+        snapshot_close(s);
+        r = 1;
+
+finish:
+        adopt_lease_fds(event, names, n);
+
+        for (i = 0; i < n; i++)
+                free(names[i]);
+        free(names);
+
+        return r;
 }
 
-int populate_pool() {
-        Slice *slice;
-        int i;
+static int load_snapshot(uint64_t *ret_seqnum) {
+        bool keep_volatile = false;
+        Snapshot *s;
+        char *path;
+        int r;
+
+        path = state_path("snapshot");
+        if (!path)
+                return -ENOMEM;
+
+        r = snapshot_open(path, &s);
+        if (r == -ENOENT) {
+                pool->init();
+                *ret_seqnum = 0;
+                r = 0;
+                goto finish;
+        }
+        if (r < 0) {
+                log_error("Failed to open %s: %s", path, strerror(-r));
+                goto finish;
+        }
 
-        root = new0(Chunk, INIT_CHUNK_COUNT+1);
-        slice = &(pool[CHUNK_MAX_EXP-1]);
+        r = reserve_leases(s);
+        if (r < 0)
+                goto close;
 
-        for (i = 0; i < INIT_CHUNK_COUNT; i++) {
-                root[i].start = POOL_START + (i * CHUNK_MAX);
-                root[i].size = CHUNK_MAX_EXP;
-                printf("initial chunk %d, start: %llu size: %u (%llu)\n", i+1, root[i].start, root[i].size, 1ULL << (root[i].size)-1);
-                LIST_APPEND(freelist, slice->list, &(root[i]));
+        r = snapshot_restore(s, pool, lease_restore, &keep_volatile);
+        if (r < 0) {
+                log_error("Failed to restore %s: %s", path, strerror(-r));
+                goto close;
         }
-        return i;
+
+        *ret_seqnum = snapshot_seqnum(s);
+
+close:
+        snapshot_close(s);
+finish:
+        free(path);
+        return r;
 }
 
-typedef struct Lease Lease;
-struct Lease {
-        Chunk *chunk;
-        char *id;
-        char *alias;
-        uint32_t persistent;
-};
+static int on_snapshot_exit(sd_event_source *s, const siginfo_t *si, void *userdata) {
+        int r;
 
-Hashmap *leasemap;
-Hashmap *aliasmap;
+        snapshot_child_source = sd_event_source_unref(snapshot_child_source);
 
-int bus_lease_release(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        if (si->si_code != CLD_EXITED || si->si_status != EXIT_SUCCESS) {
+                log_error("Snapshot writer %i failed, retrying on the next interval", (int) si->si_pid);
+                snapshot_backoff = true;
+                return 0;
+        }
+
+        r = journal_drop_rotated(journal, snapshot_child_seqnum);
+        if (r < 0)
+                log_error("Failed to remove rotated journal: %s", strerror(-r));
+
+        return 0;
+}
+
+/* The snapshot is written by a forked child, which works on a
+ * copy-on-write image of the lease table while the event loop carries
+ * on. Everything journaled after the fork goes to a fresh file, so the
+ * old one can be dropped once the child reports success. */
+static int start_snapshot(sd_event *event) {
+        pid_t pid;
         int r;
-        Lease *lease = userdata;
 
-        printf("releaseing: %s\n", lease->id);
-        
-        hashmap_remove(leasemap, lease->id);
+        if (snapshot_child_source)
+                return 0;
 
-        free_chunk(lease->chunk);
-        free(lease->id);
-        free(lease->alias);
-        free(lease);
+        r = journal_rotate(journal);
+        if (r < 0 && r != -EEXIST)
+                log_error("Failed to rotate journal: %s", strerror(-r));
 
+        pid = fork();
+        if (pid < 0)
+                return -errno;
 
-        r = sd_bus_reply_method_return(m, "");
+        if (pid == 0) {
+                r = save_snapshot();
+                if (r < 0)
+                        log_error("Failed to write snapshot: %s", strerror(-r));
+
+                _exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+
+        snapshot_last_seqnum = snapshot_child_seqnum = journal_written_seqnum(journal);
+
+        r = sd_event_add_child(event, &snapshot_child_source, pid, WEXITED, on_snapshot_exit, NULL);
         if (r < 0) {
-                log_error("Failed to send reply: %s", strerror(-r));
+                (void) kill(pid, SIGKILL);
+                (void) waitpid(pid, NULL, 0);
                 return r;
         }
 
+        return 0;
+}
 
-        return 1;
+static int on_snapshot_post(sd_event_source *s, void *userdata) {
+        int r;
+
+        if (snapshot_backoff || journal_size(journal) < SNAPSHOT_JOURNAL_SIZE)
+                return 0;
+
+        r = start_snapshot(userdata);
+        if (r < 0) {
+                log_error("Failed to start snapshot: %s", strerror(-r));
+                snapshot_backoff = true;
+        }
+
+        return 0;
 }
-int bus_lease_get_start(sd_bus *bus, const char *path, const char *interface, const char *property, sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
-        Lease *lease = userdata;
 
-        sd_bus_message_append(reply, "t", lease->chunk->start);
-        return 1;
+static int on_snapshot_timer(sd_event_source *s, uint64_t usec, void *userdata) {
+        int r;
+
+        snapshot_backoff = false;
+
+        if (journal_seqnum(journal) != snapshot_last_seqnum) {
+                r = start_snapshot(userdata);
+                if (r < 0) {
+                        log_error("Failed to start snapshot: %s", strerror(-r));
+                        snapshot_backoff = true;
+                }
+        }
+
+        r = sd_event_source_set_time(s, usec + SNAPSHOT_INTERVAL_USEC);
+        if (r < 0)
+                return r;
+
+        return sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
 }
-int bus_lease_get_end(sd_bus *bus, const char *path, const char *interface, const char *property, sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
-        Lease *lease = userdata;
 
-        sd_bus_message_append(reply, "t", lease->chunk->start + (1ULL << (lease->chunk->size -1)) - 1);
-        return 1;
+static int on_quarantine_timer(sd_event_source *s, uint64_t usec, void *userdata) {
+        while (quarantine && quarantine->quarantine_until <= usec)
+                lease_evict(quarantine);
+
+        quarantine_arm();
+        return 0;
 }
-int bus_lease_get_size(sd_bus *bus, const char *path, const char *interface, const char *property, sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
-        Lease *lease = userdata;
 
-        sd_bus_message_append(reply, "t", 1ULL << (lease->chunk->size -1));
-        return 1;
+static int on_wheel_timer(sd_event_source *s, uint64_t usec, void *userdata) {
+        wheel_advance(usec / WHEEL_TICK_USEC);
+
+        wheel_arm();
+        expire_arm();
+        return 0;
 }
 
-int bus_lease_alloc(sd_bus *bus, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+static int on_expire(sd_event_source *s, void *userdata) {
+        unsigned n;
+
+        for (n = 0; expired && n < EXPIRE_BATCH; n++) {
+                Lease *lease = expired;
+
+                /* Still waiting for the journal along with others,
+                 * try again on the next tick */
+                if (lease->committing) {
+                        LIST_REMOVE(wheel, expired, lease);
+                        wheel_insert(lease);
+                        continue;
+                }
+
+                printf("expiring: " LEASE_FMT "\n", LEASE_FMT_ARGS(lease));
+                lease_retire(lease);
+        }
+
+        wheel_arm();
+        expire_arm();
+        return 0;
+}
+
+static int attach_expiry(sd_event *event) {
         int r;
-        uint64_t size;
-        uint32_t persistent;
-        Lease *lease;
-        char path[] = "/be/enospc/uidallocd/leases/xx_xxxxxxxxxxxxxxxx";
-        char *id = &(path[28]);
-        char *alias = NULL;
 
-        r = sd_bus_message_read(m, "stb", &alias, &size, &persistent);
-        if (r < 0) {
-                log_error("Failed to read request: %s", strerror(-r));
+        r = sd_event_add_time(event, &wheel_source, CLOCK_MONOTONIC, 0, 0, on_wheel_timer, NULL);
+        if (r < 0)
                 return r;
-        }
-        
-        lease = new0(Lease, 1);
-        lease->chunk = alloc_chunk(size);
 
-        snprintf(id, 20,"%02x_%016lx", lease->chunk->size, lease->chunk->start);
-        lease->id = strdup(id);
-        hashmap_put(leasemap, lease->id, lease);
+        /* Reclaiming is left for when there is nothing else to do */
+        r = sd_event_add_defer(event, &expire_source, on_expire, NULL);
+        if (r >= 0)
+                r = sd_event_source_set_priority(expire_source, SD_EVENT_PRIORITY_IDLE);
+        if (r < 0)
+                return r;
 
-        if (strlen(alias) > 0) {
-                int r;
-                lease->alias = strdup(alias);
+        wheel_arm();
+        expire_arm();
+        return 0;
+}
+
+static int attach_quarantine(sd_event *event) {
+        int r;
+
+        r = sd_event_add_time(event, &quarantine_source, CLOCK_MONOTONIC, 0, 0, on_quarantine_timer, NULL);
+        if (r < 0)
+                return r;
+
+        quarantine_arm();
+        return 0;
+}
+
+static int attach_snapshots(sd_event *event) {
+        uint64_t now;
+        int r;
 
-                r = hashmap_put(aliasmap, lease->alias, lease);
+        snapshot_last_seqnum = journal_seqnum(journal);
+
+        r = sd_event_add_post(event, NULL, on_snapshot_post, event);
+        if (r < 0)
+                return r;
+
+        r = sd_event_now(event, CLOCK_MONOTONIC, &now);
+        if (r < 0)
+                return r;
+
+        return sd_event_add_time(event, NULL, CLOCK_MONOTONIC, now + SNAPSHOT_INTERVAL_USEC, 0, on_snapshot_timer, event);
+}
+
+/* Brings back the snapshot plus whatever was journaled after it was
+ * taken, and folds that tail into a fresh snapshot so the next start
+ * does not have to replay it again */
+static int load_state(sd_event *event) {
+        unsigned n_replayed = 0;
+        uint64_t seqnum;
+        char *path;
+        Journal *j;
+        int r;
+
+        if (arg_state_dir) {
+                state_dir = strdup(arg_state_dir);
+                if (!state_dir)
+                        return -ENOMEM;
+        } else
+                state_dir = default_state_dir();
+
+        if (state_dir) {
+                r = mkdir_parents(state_dir, 0700);
                 if (r < 0) {
-                        sd_bus_reply_method_errno(m, -r, NULL);
-                        return 1;
+                        log_error("Failed to create %s: %s", state_dir, strerror(-r));
+
+                        /* Asked for explicitly, so don't ignore it */
+                        if (arg_state_dir)
+                                return r;
+
+                        free(state_dir);
+                        state_dir = NULL;
                 }
         }
 
-        r = sd_bus_reply_method_return(m, "ott", path, lease->chunk->start, 1ULL << (lease->chunk->size -1));
-        if (r < 0) {
-                log_error("Failed to send reply: %s", strerror(-r));
+        r = load_stash(event, &seqnum);
+        if (r == 0) {
+                if (state_dir)
+                        r = load_snapshot(&seqnum);
+                else
+                        pool->init();
+        }
+        if (r < 0)
                 return r;
+
+        if (!state_dir) {
+                log_error("%s", "No usable state directory, persistent leases will not survive a restart");
+                return 0;
         }
 
-        return 1;
+        path = state_path("journal");
+        if (!path)
+                return -ENOMEM;
+
+        r = journal_open(path, &j);
+        if (r < 0) {
+                log_error("Failed to open %s: %s", path, strerror(-r));
+                goto finish;
+        }
+
+        r = journal_replay(j, seqnum, lease_replay, &n_replayed);
+        if (r < 0) {
+                log_error("Failed to replay %s: %s", path, strerror(-r));
+                journal_close(j);
+                goto finish;
+        }
+
+        journal = j;
+        printf("restored %u persistent leases, %u from the journal\n", uint64_hashmap_size(leasemap), n_replayed);
+
+        if (n_replayed > 0) {
+                r = save_snapshot();
+                if (r >= 0)
+                        r = journal_truncate(journal);
+                if (r < 0) {
+                        /* Not fatal, the journal still has it all */
+                        log_error("Failed to compact %s: %s", path, strerror(-r));
+                        r = 0;
+                }
+        }
+
+finish:
+        free(path);
+        return r;
 }
 
-static const sd_bus_vtable lease_vtable[] = {
-        SD_BUS_VTABLE_START(0),
-        SD_BUS_METHOD("Release", "", "", bus_lease_release, SD_BUS_VTABLE_UNPRIVILEGED),
-        SD_BUS_PROPERTY("Start", "t", bus_lease_get_start, 0, SD_BUS_VTABLE_PROPERTY_CONST),
-        SD_BUS_PROPERTY("End", "t", bus_lease_get_end, 0, SD_BUS_VTABLE_PROPERTY_CONST),
-        SD_BUS_PROPERTY("Size", "t", bus_lease_get_size, 0, SD_BUS_VTABLE_PROPERTY_CONST),
-        SD_BUS_PROPERTY("ID", "s", NULL, offsetof(Lease, id), SD_BUS_VTABLE_PROPERTY_CONST),
-        SD_BUS_PROPERTY("Alias", "s", NULL, offsetof(Lease, alias), SD_BUS_VTABLE_PROPERTY_CONST),
-        SD_BUS_VTABLE_END,
-};
+/* Opens up the slots nobody claimed back, and makes sure that every
+ * lease is found at its path, which is what clients hold on to */
+static void finish_restore(void) {
+        Lease *lease;
+        Iterator i;
 
-static const sd_bus_vtable main_vtable[] = {
-        SD_BUS_VTABLE_START(0),
-        SD_BUS_METHOD("AllocUids", "stb", "ott", bus_lease_alloc, SD_BUS_VTABLE_UNPRIVILEGED),
-        SD_BUS_VTABLE_END,
-};
+        lease_handles_restored();
 
-int lease_object_find(sd_bus *bus, const char *path, const char *interface, void *userdata, void **found, sd_bus_error *error) {
-        Lease *lease = NULL;
-        char *id;
-        char *alias;
+        UINT64_HASHMAP_FOREACH(lease, leasemap, i) {
+                char path[LEASE_PATH_MAX];
 
-        id = startswith(path, "/be/enospc/uidallocd/leases/");
-        alias = startswith(path, "/be/enospc/uidallocd/aliases/");
-        if (id)
-                lease = hashmap_get(leasemap, id);
-        if (alias)
-                lease = hashmap_get(aliasmap, alias);
+                if (lease_find(lease_path(lease, path)) != lease)
+                        log_error("Lease " LEASE_FMT " is not reachable at %s after restoring", LEASE_FMT_ARGS(lease), path);
+        }
+}
 
-        if (!lease)
-                return 0;
+static void help(void) {
+        printf("uidallocd [OPTIONS...]\n\n"
+               "Hands out ranges of uids over the bus.\n\n"
+               "  -h --help                 Show this help\n"
+               "     --allocator=MODE       Allocate power-of-two chunks (buddy, default)\n"
+               "                            or exact-size extents (extent)\n"
+               "     --state-dir=PATH       Keep persistent leases and snapshots in PATH,\n"
+               "                            instead of $STATE_DIRECTORY or the XDG\n"
+               "                            state directory\n"
+               "     --quarantine=SEC       Hold released aliased ranges for SEC seconds,\n"
+               "                            so the same alias gets them back\n");
+}
+
+static int parse_argv(int argc, char *argv[]) {
+        enum {
+                ARG_ALLOCATOR = 0x100,
+                ARG_STATE_DIR,
+                ARG_QUARANTINE,
+        };
+
+        static const struct option options[] = {
+                { "help",       no_argument,       NULL, 'h'            },
+                { "allocator",  required_argument, NULL, ARG_ALLOCATOR  },
+                { "state-dir",  required_argument, NULL, ARG_STATE_DIR  },
+                { "quarantine", required_argument, NULL, ARG_QUARANTINE },
+                {}
+        };
+
+        int c;
+
+        while ((c = getopt_long(argc, argv, "h", options, NULL)) >= 0)
+                switch (c) {
+
+                case 'h':
+                        help();
+                        return 0;
+
+                case ARG_ALLOCATOR:
+                        if (streq(optarg, buddy_pool_ops.name))
+                                pool = &buddy_pool_ops;
+                        else if (streq(optarg, extent_pool_ops.name))
+                                pool = &extent_pool_ops;
+                        else {
+                                log_error("Unknown allocator: %s", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+
+                case ARG_STATE_DIR:
+                        arg_state_dir = optarg;
+                        break;
+
+                case ARG_QUARANTINE: {
+                        unsigned long long sec;
+                        char *e;
+
+                        errno = 0;
+                        sec = strtoull(optarg, &e, 10);
+                        if (errno != 0 || e == optarg || *e || sec > UINT64_MAX / 1000000ULL) {
+                                log_error("Invalid quarantine period: %s", optarg);
+                                return -EINVAL;
+                        }
+
+                        arg_quarantine_usec = sec * 1000000ULL;
+                        break;
+                }
+
+                case '?':
+                        return -EINVAL;
+
+                default:
+                        assert(false);
+                }
 
-        *found = lease;
         return 1;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+        sigset_t mask;
         int r;
         sd_bus *bus = NULL;
         sd_event *event = NULL;
 
-        r = populate_pool();
+        r = parse_argv(argc, argv);
+        if (r <= 0)
+                goto end;
+
+        /* Snapshot writers are reaped and termination is handled by
+         * the event loop, which needs the signals blocked before the
+         * journal starts its thread */
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGINT);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+
+        wheel.now = now_usec() / WHEEL_TICK_USEC;
+        random_bytes(&handles.seed, sizeof(handles.seed));
+
+        leasemap = uint64_hashmap_new();
+        aliasmap = string_hashmap_new();
+        ownermap = bus_name_hashmap_new();
+
+        /* Lease handles handed over by our predecessor are watched
+         * from the moment their leases are restored */
+        r = sd_event_default(&event);
+        if (r < 0) {
+                log_error("Failed to open event loop: %s", strerror(-r));
+                goto end;
+        }
+
+        r = load_state(event);
         if (r < 0)
                 goto end;
-        leasemap = hashmap_new(&string_hash_ops);
-        aliasmap = hashmap_new(&string_hash_ops);
+
+        finish_restore();
 
 
         r = sd_bus_default_user(&bus);
@@ -279,9 +2724,38 @@ int main() {
                 log_error("Failed to connect to the bus: %s", strerror(-r));
                 goto end;
         }
-        r = sd_event_default(&event);
+
+        if (journal) {
+                r = journal_attach_event(journal, event);
+                if (r < 0) {
+                        log_error("Failed to attach journal to event loop: %s", strerror(-r));
+                        goto end;
+                }
+
+                r = attach_snapshots(event);
+                if (r < 0) {
+                        log_error("Failed to set up snapshots: %s", strerror(-r));
+                        goto end;
+                }
+        }
+
+        r = attach_quarantine(event);
         if (r < 0) {
-                log_error("Failed to open event loop: %s", strerror(-r));
+                log_error("Failed to set up quarantine: %s", strerror(-r));
+                goto end;
+        }
+
+        r = attach_expiry(event);
+        if (r < 0) {
+                log_error("Failed to set up lease expiry: %s", strerror(-r));
+                goto end;
+        }
+
+        r = sd_event_add_signal(event, NULL, SIGTERM, NULL, NULL);
+        if (r >= 0)
+                r = sd_event_add_signal(event, NULL, SIGINT, NULL, NULL);
+        if (r < 0) {
+                log_error("Failed to set up signal handling: %s", strerror(-r));
                 goto end;
         }
 
@@ -315,9 +2789,25 @@ int main() {
                 goto end;
         }
 
+        r = owners_watch(bus);
+        if (r < 0) {
+                log_error("Failed to watch lease owners: %s", strerror(-r));
+                goto end;
+        }
+
         r = sd_event_loop(event);
+        if (r >= 0) {
+                int k;
+
+                k = stash_state();
+                if (k < 0)
+                        log_error("Failed to stash state: %s", strerror(-k));
+        }
 
 end:
+        journal_close(journal);
+        free(state_dir);
+
         if (r < 0)
                 return EXIT_FAILURE;
         return EXIT_SUCCESS;
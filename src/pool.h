@@ -0,0 +1,75 @@
+#pragma once
+
+#include <assert.h>
+
+#include "util.h"
+
+#define POOL_START (1ULL<<31)
+#define POOL_END UINT32_MAX
+#define CHUNK_MAX_EXP 28
+#define CHUNK_MIN_EXP 17
+//#define POOL_START 0
+//#define POOL_END 2047
+//#define CHUNK_MAX_EXP 8
+//#define CHUNK_MIN_EXP 1
+
+/* Chunk sizes are stored as log2(length) + 1, so a chunk of size n
+ * covers 1 << (n - 1) uids. */
+#define POOL_SIZE (POOL_END - POOL_START + 1)
+#define CHUNK_MAX (1ULL << (CHUNK_MAX_EXP - 1))
+#define CHUNK_MIN (1ULL << (CHUNK_MIN_EXP - 1))
+#define INIT_CHUNK_COUNT (POOL_SIZE / CHUNK_MAX)
+
+#define CHUNK_LEN(size) (1ULL << ((size) - 1))
+
+typedef struct Extent Extent;
+
+/* A range handed out by the pool. For the buddy allocator len is
+ * always CHUNK_LEN(size), extents are exactly as long as requested and
+ * size is only their length rounded up to the next power of two. */
+typedef struct Chunk {
+        uint64_t start;
+        uint64_t len;
+        uint32_t size;
+        Extent *extent;
+} Chunk;
+
+struct pool_ops {
+        const char *name;
+        void (*init)(void);
+        int (*alloc)(uint64_t len, Chunk *ret);
+        /* What alloc() would return for len right now, in constant
+         * time and without changing anything */
+        int (*can_alloc)(uint64_t len);
+        /* How many uids alloc() hands out when asked for len */
+        uint64_t (*chunk_len)(uint64_t len);
+        int (*claim)(uint64_t start, uint64_t len, Chunk *ret);
+
+        /* Starts over with exactly the given chunks allocated, in one
+         * pass. They must be sorted by start and only have start and
+         * len set, the rest is filled in. */
+        int (*build)(Chunk *chunks, size_t n);
+
+        void (*free)(Chunk *c);
+        /* Changes the length of an allocated chunk without moving its
+         * start, -EBUSY if the uids it would grow into are taken */
+        int (*resize)(Chunk *c, uint64_t len);
+        uint64_t (*free_uids)(void);
+
+        /* Raw allocator state for snapshots, which restore() takes
+         * back verbatim. The chunks of the leases in a restored pool
+         * are then obtained one by one through restore_chunk(). */
+        const void *(*state)(size_t *ret_size);
+        int (*restore)(const void *state, size_t size);
+        int (*restore_chunk)(uint64_t start, uint64_t len, Chunk *ret);
+};
+
+extern const struct pool_ops buddy_pool_ops;
+extern const struct pool_ops extent_pool_ops;
+
+static inline uint32_t bitsize(uint64_t in) {
+        assert(in > 0);
+        if (in == 1)
+                return 1;
+        return (uint32_t) (sizeof(long) * __CHAR_BIT__ - __builtin_clzl(in-1))+1;
+}
@@ -18,6 +18,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SIPHASH_MULTI 1
+#endif
+
 #include "siphash24.h"
 
 typedef uint64_t u64;
@@ -52,8 +57,9 @@ typedef uint8_t u8;
     v2 += v1; v1=ROTL(v1,17); v1 ^= v2; v2=ROTL(v2,32); \
   } while(0)
 
-/* SipHash-2-4 */
-void siphash24(uint8_t out[8], const void *_in, size_t inlen, const uint8_t k[16])
+/* SipHash-c-d. Always inlined, so that every caller below gets a copy
+   with the round counts and, where given, the input length folded in */
+static inline __attribute__((always_inline)) void siphash(uint8_t out[8], const void *_in, size_t inlen, const uint8_t k[16], const int c, const int d)
 {
   /* "somepseudorandomlygeneratedbytes" */
   u64 v0 = 0x736f6d6570736575ULL;
@@ -64,6 +70,7 @@ void siphash24(uint8_t out[8], const void *_in, size_t inlen, const uint8_t k[16
   u64 k0 = U8TO64_LE( k );
   u64 k1 = U8TO64_LE( k + 8 );
   u64 m;
+  int i;
   const u8 *in = _in;
   const u8 *end = in + inlen - ( inlen % sizeof( u64 ) );
   const int left = inlen & 7;
@@ -84,8 +91,7 @@ void siphash24(uint8_t out[8], const void *_in, size_t inlen, const uint8_t k[16
     printf( "(%3d) compress %08x %08x\n", ( int )inlen, ( u32 )( m >> 32 ), ( u32 )m );
 #endif
     v3 ^= m;
-    SIPROUND;
-    SIPROUND;
+    for ( i = 0; i < c; ++i ) SIPROUND;
     v0 ^= m;
   }
 
@@ -116,8 +122,7 @@ void siphash24(uint8_t out[8], const void *_in, size_t inlen, const uint8_t k[16
   printf( "(%3d) padding   %08x %08x\n", ( int )inlen, ( u32 )( b >> 32 ), ( u32 )b );
 #endif
   v3 ^= b;
-  SIPROUND;
-  SIPROUND;
+  for ( i = 0; i < c; ++i ) SIPROUND;
   v0 ^= b;
 #ifdef DEBUG
   printf( "(%3d) v0 %08x %08x\n", ( int )inlen, ( u32 )( v0 >> 32 ), ( u32 )v0 );
@@ -125,6 +130,112 @@ void siphash24(uint8_t out[8], const void *_in, size_t inlen, const uint8_t k[16
   printf( "(%3d) v2 %08x %08x\n", ( int )inlen, ( u32 )( v2 >> 32 ), ( u32 )v2 );
   printf( "(%3d) v3 %08x %08x\n", ( int )inlen, ( u32 )( v3 >> 32 ), ( u32 )v3 );
 #endif
+  v2 ^= 0xff;
+  for ( i = 0; i < d; ++i ) SIPROUND;
+  b = v0 ^ v1 ^ v2  ^ v3;
+  U64TO8_LE( out, b );
+}
+
+/* SipHash-2-4 */
+void siphash24(uint8_t out[8], const void *in, size_t inlen, const uint8_t k[16])
+{
+  siphash( out, in, inlen, k, 2, 4 );
+}
+
+/* SipHash-2-4 of exactly 8 and 16 bytes, without the block loop and
+   the tail switch. Same output as siphash24() with that length. */
+void siphash24_8(uint8_t out[8], const void *in, const uint8_t k[16])
+{
+  siphash( out, in, 8, k, 2, 4 );
+}
+
+void siphash24_16(uint8_t out[8], const void *in, const uint8_t k[16])
+{
+  siphash( out, in, 16, k, 2, 4 );
+}
+
+/* SipHash-1-3 */
+void siphash13(uint8_t out[8], const void *in, size_t inlen, const uint8_t k[16])
+{
+  siphash( out, in, inlen, k, 1, 3 );
+}
+
+/* Incremental SipHash-2-4: feeding the input in any number of pieces
+   gives the same output as siphash24() on all of it */
+void siphash24_init(struct siphash *state, const uint8_t k[16])
+{
+  u64 k0 = U8TO64_LE( k );
+  u64 k1 = U8TO64_LE( k + 8 );
+
+  /* "somepseudorandomlygeneratedbytes" */
+  state->v0 = 0x736f6d6570736575ULL ^ k0;
+  state->v1 = 0x646f72616e646f6dULL ^ k1;
+  state->v2 = 0x6c7967656e657261ULL ^ k0;
+  state->v3 = 0x7465646279746573ULL ^ k1;
+  state->padding = 0;
+  state->inlen = 0;
+}
+
+void siphash24_compress(const void *_in, size_t inlen, struct siphash *state)
+{
+  u64 v0 = state->v0;
+  u64 v1 = state->v1;
+  u64 v2 = state->v2;
+  u64 v3 = state->v3;
+  u64 m;
+  const u8 *in = _in;
+  const u8 *end = in + inlen;
+  int left = state->inlen & 7;
+
+  state->inlen += inlen;
+
+  /* Complete the word left over from the previous call */
+  if ( left > 0 )
+  {
+    for ( ; in < end && left < 8; in++, left++ )
+      state->padding |= ( ( u64 )*in ) << ( left * 8 );
+
+    if ( left < 8 )
+      return;
+
+    m = state->padding;
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+    state->padding = 0;
+  }
+
+  for ( ; end - in >= 8; in += 8 )
+  {
+    m = U8TO64_LE( in );
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+
+  for ( left = 0; in < end; in++, left++ )
+    state->padding |= ( ( u64 )*in ) << ( left * 8 );
+
+  state->v0 = v0;
+  state->v1 = v1;
+  state->v2 = v2;
+  state->v3 = v3;
+}
+
+void siphash24_finalize(uint8_t out[8], struct siphash *state)
+{
+  u64 v0 = state->v0;
+  u64 v1 = state->v1;
+  u64 v2 = state->v2;
+  u64 v3 = state->v3;
+  u64 b = state->padding | ( ( u64 )state->inlen ) << 56;
+
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
   v2 ^= 0xff;
   SIPROUND;
   SIPROUND;
@@ -133,3 +244,197 @@ void siphash24(uint8_t out[8], const void *_in, size_t inlen, const uint8_t k[16
   b = v0 ^ v1 ^ v2  ^ v3;
   U64TO8_LE( out, b );
 }
+
+#ifdef SIPHASH_MULTI
+
+/* Multi-buffer SipHash-2-4: lane l hashes in[l] in the same way as
+   siphash24() does. The block loop runs for the longest input; a lane
+   that has compressed its final word keeps its state from then on. */
+
+/* The padded final message word */
+static inline u64 siphash_last(const u8 *in, size_t inlen)
+{
+  u64 b = ( ( u64 )inlen ) << 56;
+  int left;
+
+  in += inlen - ( inlen & 7 );
+  for ( left = inlen & 7; left > 0; --left )
+    b |= ( ( u64 )in[left - 1] ) << ( 8 * ( left - 1 ) );
+
+  return b;
+}
+
+#define ROTL4(x,b) _mm256_or_si256( _mm256_slli_epi64( x, b ), _mm256_srli_epi64( x, 64 - ( b ) ) )
+
+#define SIPROUND4           \
+  do {              \
+    v0 = _mm256_add_epi64( v0, v1 ); v1 = ROTL4( v1, 13 ); v1 = _mm256_xor_si256( v1, v0 ); v0 = _mm256_shuffle_epi32( v0, 0xb1 ); \
+    v2 = _mm256_add_epi64( v2, v3 ); v3 = _mm256_shuffle_epi8( v3, rot16 ); v3 = _mm256_xor_si256( v3, v2 ); \
+    v0 = _mm256_add_epi64( v0, v3 ); v3 = ROTL4( v3, 21 ); v3 = _mm256_xor_si256( v3, v0 ); \
+    v2 = _mm256_add_epi64( v2, v1 ); v1 = ROTL4( v1, 17 ); v1 = _mm256_xor_si256( v1, v2 ); v2 = _mm256_shuffle_epi32( v2, 0xb1 ); \
+  } while(0)
+
+__attribute__((target("avx2")))
+static void siphash24_x4(uint8_t out[][8], const void *const in[], const size_t inlen[], const uint8_t k[16])
+{
+  u64 k0 = U8TO64_LE( k );
+  u64 k1 = U8TO64_LE( k + 8 );
+  __m256i v0 = _mm256_set1_epi64x( 0x736f6d6570736575ULL ^ k0 );
+  __m256i v1 = _mm256_set1_epi64x( 0x646f72616e646f6dULL ^ k1 );
+  __m256i v2 = _mm256_set1_epi64x( 0x6c7967656e657261ULL ^ k0 );
+  __m256i v3 = _mm256_set1_epi64x( 0x7465646279746573ULL ^ k1 );
+  __m256i rot16 = _mm256_set_epi8( 13, 12, 11, 10, 9, 8, 15, 14, 5, 4, 3, 2, 1, 0, 7, 6,
+                                   13, 12, 11, 10, 9, 8, 15, 14, 5, 4, 3, 2, 1, 0, 7, 6 );
+  __m256i m, live, s0, s1, s2, s3;
+  u64 w[4], a[4], b[4], last[4];
+  size_t j, n = 0, blocks[4];
+  int l;
+
+  for ( l = 0; l < 4; ++l )
+  {
+    blocks[l] = inlen[l] / 8;
+    last[l] = siphash_last( in[l], inlen[l] );
+    if ( blocks[l] > n )
+      n = blocks[l];
+  }
+
+  for ( j = 0; j <= n; ++j )
+  {
+    for ( l = 0; l < 4; ++l )
+    {
+      a[l] = j <= blocks[l] ? ~( u64 )0 : 0;
+      w[l] = j < blocks[l] ? U8TO64_LE( ( const u8 * )in[l] + j * 8 ) : last[l];
+    }
+
+    m = _mm256_loadu_si256( ( const __m256i * )w );
+    live = _mm256_loadu_si256( ( const __m256i * )a );
+    s0 = v0; s1 = v1; s2 = v2; s3 = v3;
+
+    v3 = _mm256_xor_si256( v3, m );
+    SIPROUND4;
+    SIPROUND4;
+    v0 = _mm256_xor_si256( v0, m );
+
+    v0 = _mm256_blendv_epi8( s0, v0, live );
+    v1 = _mm256_blendv_epi8( s1, v1, live );
+    v2 = _mm256_blendv_epi8( s2, v2, live );
+    v3 = _mm256_blendv_epi8( s3, v3, live );
+  }
+
+  v2 = _mm256_xor_si256( v2, _mm256_set1_epi64x( 0xff ) );
+  SIPROUND4;
+  SIPROUND4;
+  SIPROUND4;
+  SIPROUND4;
+  _mm256_storeu_si256( ( __m256i * )b, _mm256_xor_si256( _mm256_xor_si256( v0, v1 ), _mm256_xor_si256( v2, v3 ) ) );
+
+  for ( l = 0; l < 4; ++l )
+  {
+    U64TO8_LE( out[l], b[l] );
+  }
+}
+
+#define SIPROUND8           \
+  do {              \
+    v0 = _mm512_add_epi64( v0, v1 ); v1 = _mm512_rol_epi64( v1, 13 ); v1 = _mm512_xor_si512( v1, v0 ); v0 = _mm512_rol_epi64( v0, 32 ); \
+    v2 = _mm512_add_epi64( v2, v3 ); v3 = _mm512_rol_epi64( v3, 16 ); v3 = _mm512_xor_si512( v3, v2 ); \
+    v0 = _mm512_add_epi64( v0, v3 ); v3 = _mm512_rol_epi64( v3, 21 ); v3 = _mm512_xor_si512( v3, v0 ); \
+    v2 = _mm512_add_epi64( v2, v1 ); v1 = _mm512_rol_epi64( v1, 17 ); v1 = _mm512_xor_si512( v1, v2 ); v2 = _mm512_rol_epi64( v2, 32 ); \
+  } while(0)
+
+__attribute__((target("avx512f")))
+static void siphash24_x8(uint8_t out[][8], const void *const in[], const size_t inlen[], const uint8_t k[16])
+{
+  u64 k0 = U8TO64_LE( k );
+  u64 k1 = U8TO64_LE( k + 8 );
+  __m512i v0 = _mm512_set1_epi64( 0x736f6d6570736575ULL ^ k0 );
+  __m512i v1 = _mm512_set1_epi64( 0x646f72616e646f6dULL ^ k1 );
+  __m512i v2 = _mm512_set1_epi64( 0x6c7967656e657261ULL ^ k0 );
+  __m512i v3 = _mm512_set1_epi64( 0x7465646279746573ULL ^ k1 );
+  __m512i m, s0, s1, s2, s3;
+  __mmask8 live;
+  u64 w[8], b[8], last[8];
+  size_t j, n = 0, blocks[8];
+  int l;
+
+  for ( l = 0; l < 8; ++l )
+  {
+    blocks[l] = inlen[l] / 8;
+    last[l] = siphash_last( in[l], inlen[l] );
+    if ( blocks[l] > n )
+      n = blocks[l];
+  }
+
+  for ( j = 0; j <= n; ++j )
+  {
+    live = 0;
+    for ( l = 0; l < 8; ++l )
+    {
+      if ( j <= blocks[l] )
+        live |= 1 << l;
+      w[l] = j < blocks[l] ? U8TO64_LE( ( const u8 * )in[l] + j * 8 ) : last[l];
+    }
+
+    m = _mm512_loadu_si512( w );
+    s0 = v0; s1 = v1; s2 = v2; s3 = v3;
+
+    v3 = _mm512_xor_si512( v3, m );
+    SIPROUND8;
+    SIPROUND8;
+    v0 = _mm512_xor_si512( v0, m );
+
+    v0 = _mm512_mask_mov_epi64( s0, live, v0 );
+    v1 = _mm512_mask_mov_epi64( s1, live, v1 );
+    v2 = _mm512_mask_mov_epi64( s2, live, v2 );
+    v3 = _mm512_mask_mov_epi64( s3, live, v3 );
+  }
+
+  v2 = _mm512_xor_si512( v2, _mm512_set1_epi64( 0xff ) );
+  SIPROUND8;
+  SIPROUND8;
+  SIPROUND8;
+  SIPROUND8;
+  _mm512_storeu_si512( b, _mm512_xor_si512( _mm512_xor_si512( v0, v1 ), _mm512_xor_si512( v2, v3 ) ) );
+
+  for ( l = 0; l < 8; ++l )
+  {
+    U64TO8_LE( out[l], b[l] );
+  }
+}
+
+/* 0 for scalar only, 1 for AVX2, 2 for AVX-512 */
+static int siphash_lanes_level(void)
+{
+  static int level = -1;
+
+  if ( level < 0 )
+  {
+    __builtin_cpu_init();
+    level = __builtin_cpu_supports( "avx512f" ) ? 2 :
+            __builtin_cpu_supports( "avx2" ) ? 1 : 0;
+  }
+
+  return level;
+}
+
+#endif
+
+void siphash24_many(uint8_t out[][8], const void *const in[], const size_t inlen[], size_t n, const uint8_t k[16])
+{
+  size_t i = 0;
+
+#ifdef SIPHASH_MULTI
+  int level = siphash_lanes_level();
+
+  if ( level >= 2 )
+    for ( ; i + 8 <= n; i += 8 )
+      siphash24_x8( out + i, in + i, inlen + i, k );
+
+  if ( level >= 1 )
+    for ( ; i + 4 <= n; i += 4 )
+      siphash24_x4( out + i, in + i, inlen + i, k );
+#endif
+
+  for ( ; i < n; ++i )
+    siphash24( out[i], in[i], inlen[i], k );
+}
@@ -3,4 +3,28 @@
 #include <inttypes.h>
 #include <sys/types.h>
 
+struct siphash {
+        uint64_t v0;
+        uint64_t v1;
+        uint64_t v2;
+        uint64_t v3;
+        uint64_t padding;
+        size_t inlen;
+};
+
 void siphash24(uint8_t out[8], const void *in, size_t inlen, const uint8_t k[16]);
+void siphash24_8(uint8_t out[8], const void *in, const uint8_t k[16]);
+void siphash24_16(uint8_t out[8], const void *in, const uint8_t k[16]);
+
+/* Same output as siphash24() on the concatenation of everything
+ * passed to siphash24_compress() */
+void siphash24_init(struct siphash *state, const uint8_t k[16]);
+void siphash24_compress(const void *in, size_t inlen, struct siphash *state);
+void siphash24_finalize(uint8_t out[8], struct siphash *state);
+
+/* Same as calling siphash24() on each of the n inputs, but hashes
+ * four or eight of them at a time if the CPU has AVX2 or AVX-512 */
+void siphash24_many(uint8_t out[][8], const void *const in[], const size_t inlen[], size_t n, const uint8_t k[16]);
+
+/* Fewer rounds, for keys that are not under the control of clients */
+void siphash13(uint8_t out[8], const void *in, size_t inlen, const uint8_t k[16]);
@@ -0,0 +1,514 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "hashmap.h"
+#include "siphash24.h"
+
+#define SNAPSHOT_MAGIC "UIDSNAP1"
+#define SNAPSHOT_VERSION 3
+
+#define SNAPSHOT_LEASE_FLAGS (SNAPSHOT_LEASE_PERSISTENT|SNAPSHOT_LEASE_QUARANTINED|SNAPSHOT_LEASE_EXPIRES|SNAPSHOT_LEASE_HANDLE|SNAPSHOT_LEASE_FD|SNAPSHOT_LEASE_OWNED)
+
+#define VARINT_MAX 10
+
+/* All offsets are from the start of the file, the checksum covers
+ * everything that follows it */
+typedef struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint64_t checksum;
+
+        char allocator[16];
+        uint64_t pool_start;
+        uint64_t pool_end;
+        uint32_t chunk_min_exp;
+        uint32_t chunk_max_exp;
+
+        uint64_t seqnum;
+        uint64_t n_leases;
+        uint64_t state_offset;
+        uint64_t state_size;
+        uint64_t leases_offset;
+        uint64_t leases_size;
+} SnapshotHeader;
+
+struct Snapshot {
+        uint8_t *map;
+        size_t size;
+        const SnapshotHeader *header;
+        size_t n_aliases;
+};
+
+static const uint8_t checksum_key[HASH_KEY_SIZE] = {};
+
+static uint64_t snapshot_checksum(const uint8_t *p, size_t size) {
+        size_t skip = offsetof(SnapshotHeader, checksum) + sizeof(uint64_t);
+        uint64_t u;
+
+        siphash24((uint8_t*) &u, p + skip, size - skip, checksum_key);
+        return u;
+}
+
+static uint8_t *varint_put(uint8_t *p, uint64_t v) {
+        while (v >= 0x80) {
+                *(p++) = (v & 0x7f) | 0x80;
+                v >>= 7;
+        }
+        *(p++) = v;
+
+        return p;
+}
+
+static const uint8_t *varint_get(const uint8_t *p, const uint8_t *end, uint64_t *ret) {
+        uint64_t v = 0;
+        unsigned shift;
+
+        for (shift = 0; p < end && shift < 64; shift += 7) {
+                v |= (uint64_t) (*p & 0x7f) << shift;
+                if (!(*(p++) & 0x80)) {
+                        *ret = v;
+                        return p;
+                }
+        }
+
+        return NULL;
+}
+
+static int snapshot_lease_compare(const void *a, const void *b) {
+        const SnapshotLease *x = a, *y = b;
+
+        return x->start < y->start ? -1 : (x->start > y->start ? 1 : 0);
+}
+
+int snapshot_serialize(const struct pool_ops *pool, uint64_t seqnum, SnapshotLease *leases, size_t n_leases, void **ret, size_t *ret_size) {
+        SnapshotHeader *h;
+        const void *state;
+        size_t state_size, size, i;
+        uint64_t prev = 0;
+        uint8_t *buf, *p;
+
+        assert(pool);
+        assert(leases || n_leases == 0);
+        assert(ret);
+        assert(ret_size);
+
+        qsort(leases, n_leases, sizeof(SnapshotLease), snapshot_lease_compare);
+
+        state = pool->state(&state_size);
+
+        size = ALIGN8(sizeof(SnapshotHeader)) + ALIGN8(state_size);
+        for (i = 0; i < n_leases; i++)
+                size += 8 * VARINT_MAX + 1 + (leases[i].alias ? strlen(leases[i].alias) : 0) +
+                        (leases[i].flags & SNAPSHOT_LEASE_OWNED ? strlen(leases[i].owner) : 0);
+
+        buf = malloc0(size);
+        if (!buf)
+                return -ENOMEM;
+
+        h = (SnapshotHeader*) buf;
+        memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+        h->version = SNAPSHOT_VERSION;
+        h->header_size = sizeof(SnapshotHeader);
+        strncpy(h->allocator, pool->name, sizeof(h->allocator) - 1);
+        h->pool_start = POOL_START;
+        h->pool_end = POOL_END;
+        h->chunk_min_exp = CHUNK_MIN_EXP;
+        h->chunk_max_exp = CHUNK_MAX_EXP;
+        h->seqnum = seqnum;
+        h->n_leases = n_leases;
+
+        h->state_offset = ALIGN8(sizeof(SnapshotHeader));
+        h->state_size = state_size;
+        if (state_size > 0)
+                memcpy(buf + h->state_offset, state, state_size);
+
+        h->leases_offset = h->state_offset + ALIGN8(state_size);
+        p = buf + h->leases_offset;
+        for (i = 0; i < n_leases; i++) {
+                size_t l = leases[i].alias ? strlen(leases[i].alias) : 0;
+
+                p = varint_put(p, leases[i].start - prev);
+                p = varint_put(p, leases[i].len);
+                *(p++) = leases[i].flags;
+                p = varint_put(p, l);
+                if (l > 0)
+                        memcpy(p, leases[i].alias, l);
+                p += l;
+                if (leases[i].flags & SNAPSHOT_LEASE_EXPIRES) {
+                        p = varint_put(p, leases[i].ttl);
+                        p = varint_put(p, leases[i].remaining);
+                }
+                if (leases[i].flags & SNAPSHOT_LEASE_HANDLE) {
+                        p = varint_put(p, leases[i].slot);
+                        p = varint_put(p, leases[i].generation);
+                }
+                if (leases[i].flags & SNAPSHOT_LEASE_OWNED) {
+                        l = strlen(leases[i].owner);
+                        p = varint_put(p, l);
+                        memcpy(p, leases[i].owner, l);
+                        p += l;
+                }
+
+                prev = leases[i].start;
+        }
+        h->leases_size = p - (buf + h->leases_offset);
+
+        size = h->leases_offset + h->leases_size;
+        h->checksum = snapshot_checksum(buf, size);
+
+        *ret = buf;
+        *ret_size = size;
+        return 0;
+}
+
+int snapshot_write(const char *path, const void *buf, size_t size) {
+        const uint8_t *p = buf;
+        char *tmp, *dir;
+        int fd, r = 0;
+
+        assert(path);
+        assert(buf);
+
+        tmp = newa(char, strlen(path) + sizeof(".tmp"));
+        sprintf(tmp, "%s.tmp", path);
+
+        fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+        if (fd < 0)
+                return -errno;
+
+        while (size > 0) {
+                ssize_t k;
+
+                k = write(fd, p, size);
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        r = -errno;
+                        break;
+                }
+
+                p += k;
+                size -= k;
+        }
+
+        if (r >= 0 && fsync(fd) < 0)
+                r = -errno;
+        close(fd);
+
+        if (r >= 0 && rename(tmp, path) < 0)
+                r = -errno;
+        if (r < 0) {
+                unlink(tmp);
+                return r;
+        }
+
+        dir = newa(char, strlen(path) + 1);
+        strcpy(dir, path);
+        fd = open(dirname(dir), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+        if (fsync(fd) < 0)
+                r = -errno;
+        close(fd);
+
+        return r;
+}
+
+/* For handing the state over to the next instance of ourselves: the
+ * sealed memfd can neither change nor be resized behind our back */
+int snapshot_write_memfd(const void *buf, size_t size, int *ret_fd) {
+        const uint8_t *p = buf;
+        int fd, r;
+
+        assert(buf);
+        assert(ret_fd);
+
+        fd = memfd_create("uidallocd-state", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+        if (fd < 0)
+                return -errno;
+
+        while (size > 0) {
+                ssize_t k;
+
+                k = write(fd, p, size);
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        r = -errno;
+                        goto fail;
+                }
+
+                p += k;
+                size -= k;
+        }
+
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        *ret_fd = fd;
+        return 0;
+
+fail:
+        close(fd);
+        return r;
+}
+
+/* Decodes the lease at *p and moves *p past it, ret->start is the one
+ * of the previous lease on entry. Alias and owner are left pointing
+ * into the snapshot, which has no NUL after them. */
+static int snapshot_next_lease(const uint8_t **p, const uint8_t *end, SnapshotLease *ret, size_t *alias_len, size_t *owner_len) {
+        const uint8_t *q = *p;
+        uint64_t delta, l, slot, generation;
+
+        q = varint_get(q, end, &delta);
+        if (q)
+                q = varint_get(q, end, &ret->len);
+        if (!q || q >= end)
+                return -EBADMSG;
+        ret->flags = *(q++);
+        q = varint_get(q, end, &l);
+        if (!q || l > (uint64_t) (end - q) || ret->len == 0 || (ret->flags & ~SNAPSHOT_LEASE_FLAGS))
+                return -EBADMSG;
+
+        ret->alias = l > 0 ? (const char*) q : NULL;
+        *alias_len = l;
+        q += l;
+
+        ret->ttl = ret->remaining = 0;
+        if (ret->flags & SNAPSHOT_LEASE_EXPIRES) {
+                q = varint_get(q, end, &ret->ttl);
+                if (q)
+                        q = varint_get(q, end, &ret->remaining);
+                if (!q || ret->ttl == 0)
+                        return -EBADMSG;
+        }
+
+        ret->slot = ret->generation = 0;
+        if (ret->flags & SNAPSHOT_LEASE_HANDLE) {
+                q = varint_get(q, end, &slot);
+                if (q)
+                        q = varint_get(q, end, &generation);
+                if (!q || slot > UINT32_MAX || generation > UINT32_MAX)
+                        return -EBADMSG;
+
+                ret->slot = slot;
+                ret->generation = generation;
+        }
+
+        ret->owner = NULL;
+        *owner_len = 0;
+        if (ret->flags & SNAPSHOT_LEASE_OWNED) {
+                q = varint_get(q, end, &l);
+                if (!q || l == 0 || l > (uint64_t) (end - q))
+                        return -EBADMSG;
+
+                ret->owner = (const char*) q;
+                *owner_len = l;
+                q += l;
+        }
+
+        ret->start += delta;
+        *p = q;
+
+        return 0;
+}
+
+int snapshot_open_fd(int fd, Snapshot **ret) {
+        const SnapshotHeader *h;
+        const uint8_t *p, *end;
+        SnapshotLease lease = {};
+        struct stat st;
+        uint64_t i;
+        Snapshot *s;
+        int r;
+
+        assert(fd >= 0);
+        assert(ret);
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+        if ((uint64_t) st.st_size < sizeof(SnapshotHeader))
+                return -EBADMSG;
+
+        s = new0(Snapshot, 1);
+        if (!s)
+                return -ENOMEM;
+
+        s->size = st.st_size;
+        s->map = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (s->map == MAP_FAILED) {
+                r = -errno;
+                free(s);
+                return r;
+        }
+
+        h = s->header = (const SnapshotHeader*) s->map;
+        if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+            h->version < 1 || h->version > SNAPSHOT_VERSION ||
+            h->header_size < sizeof(SnapshotHeader) ||
+            h->state_offset < h->header_size ||
+            h->state_offset > s->size ||
+            h->state_size > s->size - h->state_offset ||
+            h->leases_offset < h->state_offset + h->state_size ||
+            h->leases_offset > s->size ||
+            h->leases_size != s->size - h->leases_offset ||
+            h->checksum != snapshot_checksum(s->map, s->size))
+                goto fail;
+
+        /* Walk the leases once, so that restoring cannot fail half way
+         * on a malformed entry, and so the caller can size its tables */
+        p = s->map + h->leases_offset;
+        end = p + h->leases_size;
+        for (i = 0; i < h->n_leases; i++) {
+                size_t l, o;
+
+                if (snapshot_next_lease(&p, end, &lease, &l, &o) < 0)
+                        goto fail;
+                if (lease.alias)
+                        s->n_aliases++;
+        }
+        if (p != end)
+                goto fail;
+
+        *ret = s;
+        return 0;
+
+fail:
+        snapshot_close(s);
+        return -EBADMSG;
+}
+
+int snapshot_open(const char *path, Snapshot **ret) {
+        int fd, r;
+
+        assert(path);
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        r = snapshot_open_fd(fd, ret);
+        close(fd);
+
+        return r;
+}
+
+uint64_t snapshot_seqnum(Snapshot *s) {
+        return s->header->seqnum;
+}
+
+size_t snapshot_n_leases(Snapshot *s) {
+        return s->header->n_leases;
+}
+
+size_t snapshot_n_aliases(Snapshot *s) {
+        return s->n_aliases;
+}
+
+int snapshot_restore(Snapshot *s, const struct pool_ops *pool, snapshot_lease_t callback, void *userdata) {
+        const SnapshotHeader *h;
+        const uint8_t *p, *end;
+        SnapshotLease lease;
+        Chunk *chunks;
+        bool verbatim;
+        uint64_t i;
+        int r = 0;
+
+        assert(s);
+        assert(pool);
+        assert(callback);
+
+        h = s->header;
+
+        chunks = new(Chunk, MAX(h->n_leases, 1ULL));
+        if (!chunks)
+                return -ENOMEM;
+
+        p = s->map + h->leases_offset;
+        end = p + h->leases_size;
+        for (i = 0, lease.start = 0; i < h->n_leases; i++) {
+                size_t l, o;
+
+                r = snapshot_next_lease(&p, end, &lease, &l, &o);
+                assert(r >= 0);
+                chunks[i].start = lease.start;
+                chunks[i].len = lease.len;
+        }
+
+        /* The allocator state can only be taken as it is if it was
+         * written by the same allocator for the same pool, otherwise
+         * the pool is rebuilt around the leases */
+        verbatim = h->state_size > 0 &&
+                   strncmp(h->allocator, pool->name, sizeof(h->allocator)) == 0 &&
+                   h->pool_start == POOL_START &&
+                   h->pool_end == POOL_END &&
+                   h->chunk_min_exp == CHUNK_MIN_EXP &&
+                   h->chunk_max_exp == CHUNK_MAX_EXP;
+        if (verbatim) {
+                r = pool->restore(s->map + h->state_offset, h->state_size);
+                for (i = 0; r >= 0 && i < h->n_leases; i++)
+                        r = pool->restore_chunk(chunks[i].start, chunks[i].len, &chunks[i]);
+        } else
+                r = pool->build(chunks, h->n_leases);
+        if (r < 0)
+                goto finish;
+
+        p = s->map + h->leases_offset;
+        for (i = 0, lease.start = 0; i < h->n_leases; i++) {
+                char *alias = NULL, *owner = NULL;
+                size_t l, o;
+
+                r = snapshot_next_lease(&p, end, &lease, &l, &o);
+                assert(r >= 0);
+
+                if (lease.alias) {
+                        alias = strndup(lease.alias, l);
+                        if (!alias) {
+                                r = -ENOMEM;
+                                break;
+                        }
+                        lease.alias = alias;
+                }
+
+                if (lease.owner) {
+                        owner = strndup(lease.owner, o);
+                        if (!owner) {
+                                free(alias);
+                                r = -ENOMEM;
+                                break;
+                        }
+                        lease.owner = owner;
+                }
+
+                r = callback(&chunks[i], &lease, userdata);
+                free(alias);
+                free(owner);
+                if (r < 0)
+                        break;
+        }
+
+finish:
+        free(chunks);
+        return r;
+}
+
+void snapshot_close(Snapshot *s) {
+        if (!s)
+                return;
+
+        if (s->map && s->map != MAP_FAILED)
+                munmap(s->map, s->size);
+        free(s);
+}
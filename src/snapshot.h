@@ -0,0 +1,55 @@
+#pragma once
+
+#include "util.h"
+#include "pool.h"
+
+/* A point-in-time image of the pool and all leases in it. The pool
+ * state is stored the way the allocator keeps it in memory, so loading
+ * it is a copy rather than a rebuild, and leases follow sorted by
+ * start with the starts delta-encoded. */
+
+typedef enum SnapshotLeaseFlags {
+        SNAPSHOT_LEASE_PERSISTENT = 1,
+        SNAPSHOT_LEASE_QUARANTINED = 2,
+        SNAPSHOT_LEASE_EXPIRES = 4,
+        SNAPSHOT_LEASE_HANDLE = 8,
+        SNAPSHOT_LEASE_FD = 16,
+        SNAPSHOT_LEASE_OWNED = 32,
+} SnapshotLeaseFlags;
+
+typedef struct SnapshotLease {
+        uint64_t start;
+        uint64_t len;
+        const char *alias;
+        unsigned flags;
+
+        /* Only with SNAPSHOT_LEASE_EXPIRES, the time left is relative
+         * so that it carries over to another clock */
+        uint64_t ttl;
+        uint64_t remaining;
+
+        /* Only with SNAPSHOT_LEASE_HANDLE, what the object path of the
+         * lease was made of */
+        uint32_t slot;
+        uint32_t generation;
+
+        /* Only with SNAPSHOT_LEASE_OWNED, the unique bus name of the
+         * client the lease goes away with */
+        const char *owner;
+} SnapshotLease;
+
+typedef struct Snapshot Snapshot;
+
+typedef int (*snapshot_lease_t)(const Chunk *chunk, const SnapshotLease *lease, void *userdata);
+
+int snapshot_serialize(const struct pool_ops *pool, uint64_t seqnum, SnapshotLease *leases, size_t n_leases, void **ret, size_t *ret_size);
+int snapshot_write(const char *path, const void *buf, size_t size);
+int snapshot_write_memfd(const void *buf, size_t size, int *ret_fd);
+
+int snapshot_open_fd(int fd, Snapshot **ret);
+int snapshot_open(const char *path, Snapshot **ret);
+uint64_t snapshot_seqnum(Snapshot *s) _pure_;
+size_t snapshot_n_leases(Snapshot *s) _pure_;
+size_t snapshot_n_aliases(Snapshot *s) _pure_;
+int snapshot_restore(Snapshot *s, const struct pool_ops *pool, snapshot_lease_t callback, void *userdata);
+void snapshot_close(Snapshot *s);